@@ -0,0 +1,599 @@
+/* rotation_bench.c
+ *
+ * Copyright (C) 2019-2023  Andrew C. Starritt
+ * All rights reserved.
+ *
+ * The rotation logger is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by the
+ * Free Software Foundation, either version 2 of the License.
+ *
+ * The rotation logger is distributed in the hope that it will be useful, but
+ * WITHOUT ANY WARRANTY; without even the implied warranty of MERCHANTABILITY
+ * or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU General Public License
+ * for more details.
+ *
+ * You should have received a copy of the GNU General Public License along
+ * with rotation logger. If not, see <http://www.gnu.org/licenses/>.
+ *
+ * Contact details:
+ * andrew.starritt@gmail.com
+ * PO Box 3118, Prahran East, Victoria 3181, Australia.
+ *
+ */
+
+/* Throughput and latency benchmark for rotation_logger.
+ *
+ * Generated input is written through a pipe to rotation_logger (in quiet mode),
+ * and a watcher thread follows the log files as they are written and rotated,
+ * using inotify. Each line starts with the time it was generated, so that the
+ * input to file latency of every line can be measured. The read/write system
+ * call counts are taken from /proc/<pid>/io once the logger has exited, but
+ * before it is reaped.
+ */
+
+#define _GNU_SOURCE
+
+#include <errno.h>
+#include <dirent.h>
+#include <fcntl.h>
+#include <getopt.h>
+#include <poll.h>
+#include <pthread.h>
+#include <signal.h>
+#include <stdarg.h>
+#include <stdbool.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/inotify.h>
+#include <sys/resource.h>
+#include <sys/stat.h>
+#include <sys/types.h>
+#include <sys/wait.h>
+#include <time.h>
+#include <unistd.h>
+
+#define MAX_LOGGER_ARGS  64
+#define MAX_LINE_SIZE    65536
+#define STAMP_DIGITS     16       /* hex nanoseconds, then a space */
+#define WATCH_BUFFER     65536
+
+/*------------------------------------------------------------------------------
+ * Growable list of latencies, in microseconds.
+ */
+typedef struct {
+   uint32_t* values;
+   size_t count;
+   size_t capacity;
+} Samples;
+
+/*------------------------------------------------------------------------------
+ */
+static struct {
+   const char* directory;
+   int inotifyFd;
+   bool stop;                    /* set once the logger has exited */
+   unsigned long long bytes;     /* data seen in the log files */
+   int files;
+   Samples latency;
+   Samples firstLine;            /* latency of the first line of each new file */
+} watch;
+
+/*------------------------------------------------------------------------------
+ */
+static void perrorf (const char* format, ...)
+{
+   char message [240];
+   va_list arguments;
+   va_start (arguments, format);
+   vsnprintf (message, sizeof (message), format, arguments);
+   va_end (arguments);
+   perror (message);
+}
+
+/*------------------------------------------------------------------------------
+ */
+static void printUsage ()
+{
+   printf ("usage: rotation_bench [OPTIONS] [-- rotation_logger options]\n"
+           "\n"
+           "--logger, -L   the rotation_logger program. The default is ./rotation_logger.\n"
+           "--mb, -m       total input in megabytes. The default is 100.\n"
+           "--line, -l     line size in bytes, including the newline. The default is 100.\n"
+           "--jitter, -j   random variation of the line size, +/- bytes. The default is 0.\n"
+           "--rate, -r     lines per second, 0 for as fast as possible. The default is 0.\n"
+           "--burst, -b    lines per write, i.e. burstiness. The default is 1.\n"
+           "--dir, -d      log directory. The default is a temporary directory, which is\n"
+           "               removed afterwards.\n"
+           "--help, -h     show this help information and exit.\n");
+}
+
+/*------------------------------------------------------------------------------
+ */
+static uint64_t monotonicNs ()
+{
+   struct timespec ts;
+   clock_gettime (CLOCK_MONOTONIC, &ts);
+   return ts.tv_sec * 1000000000ULL + ts.tv_nsec;
+}
+
+/*------------------------------------------------------------------------------
+ */
+static void sampleAdd (Samples* samples, const uint64_t ns)
+{
+   if (samples->count == samples->capacity) {
+      size_t capacity = samples->capacity ? 2 * samples->capacity : 65536;
+      uint32_t* values = realloc (samples->values, capacity * sizeof (uint32_t));
+      if (!values) return;
+      samples->values = values;
+      samples->capacity = capacity;
+   }
+   samples->values [samples->count++] = ns / 1000 > UINT32_MAX ? UINT32_MAX : ns / 1000;
+}
+
+/*------------------------------------------------------------------------------
+ */
+static int sampleCompare (const void* a, const void* b)
+{
+   const uint32_t x = *(const uint32_t*) a;
+   const uint32_t y = *(const uint32_t*) b;
+   return (x > y) - (x < y);
+}
+
+/*------------------------------------------------------------------------------
+ * The given percentile of sorted samples.
+ */
+static uint32_t percentile (const Samples* samples, const double p)
+{
+   size_t j;
+
+   if (samples->count == 0) return 0;
+   j = (size_t) (p / 100.0 * (samples->count - 1) + 0.5);
+   return samples->values [j];
+}
+
+/*------------------------------------------------------------------------------
+ * Build a generated line, other than the time, which is patched in on sending.
+ */
+static void lineFill (char* line, const int size)
+{
+   int j;
+
+   memset (line, '0', STAMP_DIGITS);
+   line [STAMP_DIGITS] = ' ';
+   for (j = STAMP_DIGITS + 1; j < size - 1; j++) {
+      line [j] = 'a' + (j % 26);
+   }
+   line [size - 1] = '\n';
+}
+
+/*------------------------------------------------------------------------------
+ */
+static void lineStamp (char* line, uint64_t ns)
+{
+   static const char hex [] = "0123456789abcdef";
+   int j;
+
+   for (j = STAMP_DIGITS - 1; j >= 0; j--) {
+      line [j] = hex [ns & 15];
+      ns >>= 4;
+   }
+}
+
+/*------------------------------------------------------------------------------
+ * Parse the line times in data seen in a log file. A partial line is carried
+ * over to the next call. Lines that do not start with a time, e.g. the tail of
+ * a line split by rotation, are just counted.
+ */
+typedef struct {
+   char carry [STAMP_DIGITS + 1];
+   int carried;
+   bool lineStart;
+   bool first;                   /* no line yet seen in this file */
+} Follow;
+
+static void followData (Follow* follow, const char* data, const size_t count,
+                        const uint64_t now)
+{
+   size_t j = 0;
+
+   while (j < count) {
+      const char* newline;
+
+      if (follow->lineStart) {
+         bool ended = false;
+
+         while (follow->carried <= STAMP_DIGITS && j < count) {
+            const char c = data [j++];
+            follow->carry [follow->carried++] = c;
+            if (c == '\n') {
+               ended = true;
+               break;
+            }
+         }
+         if (ended) {
+            follow->carried = 0;   /* short line */
+            continue;
+         }
+         if (follow->carried <= STAMP_DIGITS) return;
+
+         if (follow->carry [STAMP_DIGITS] == ' ') {
+            uint64_t ns = 0;
+            int k;
+            for (k = 0; k < STAMP_DIGITS; k++) {
+               const char c = follow->carry [k];
+               ns = ns * 16 + (c >= 'a' ? c - 'a' + 10 : c - '0');
+            }
+            sampleAdd (&watch.latency, now - ns);
+            if (follow->first) {
+               sampleAdd (&watch.firstLine, now - ns);
+               follow->first = false;
+            }
+         }
+         follow->carried = 0;
+         follow->lineStart = false;
+      }
+
+      newline = memchr (data + j, '\n', count - j);
+      if (!newline) return;
+      j = newline - data + 1;
+      follow->lineStart = true;
+   }
+}
+
+/*------------------------------------------------------------------------------
+ * Follow the log files. Files are opened as soon as created (or renamed into
+ * place when pre-created), so that they can still be read after being purged
+ * or compressed. Once the next file exists, the current file is complete, so
+ * is read to the end and closed. Compressed (gzip stream) files are ignored.
+ */
+static void* watchThread (void* arg)
+{
+   static char buffer [WATCH_BUFFER];
+   int fds [256];
+   int first = 0;
+   int last = 0;
+   Follow follow;
+
+   memset (&follow, 0, sizeof (follow));
+   follow.lineStart = true;
+   follow.first = true;
+
+   while (true) {
+      struct pollfd pfd;
+      char events [4096];
+      bool stopping = __atomic_load_n (&watch.stop, __ATOMIC_ACQUIRE);
+      ssize_t n;
+
+      pfd.fd = watch.inotifyFd;
+      pfd.events = POLLIN;
+      poll (&pfd, 1, stopping ? 0 : 10);
+
+      /* Pick up any new files. Writes also wake us, so that the latency seen
+       * is not limited by the poll timeout.
+       */
+      n = read (watch.inotifyFd, events, sizeof (events));
+      if (n > 0) {
+         char* p = events;
+         while (p < events + n) {
+            struct inotify_event* event = (struct inotify_event*) p;
+            p += sizeof (struct inotify_event) + event->len;
+
+            if (!(event->mask & (IN_CREATE | IN_MOVED_TO)) || event->len == 0 ||
+                event->name [0] == '.' || strstr (event->name, ".gz")) {
+               continue;   /* just a write, or a spare or compressed file */
+            }
+            if (last - first < 256) {
+               char path [4096];
+               snprintf (path, sizeof (path), "%s/%s", watch.directory, event->name);
+               fds [last % 256] = open (path, O_RDONLY);
+               if (fds [last % 256] >= 0) last++;
+            }
+         }
+      }
+
+      /* Read the current file, and move on to the next one once exhausted.
+       */
+      while (first < last) {
+         const int fd = fds [first % 256];
+
+         while ((n = read (fd, buffer, sizeof (buffer))) > 0) {
+            watch.bytes += n;
+            followData (&follow, buffer, n, monotonicNs ());
+         }
+         if (first + 1 == last) break;
+
+         close (fd);
+         first++;
+         watch.files++;
+         follow.first = true;
+         follow.lineStart = true;
+         follow.carried = 0;
+      }
+
+      if (stopping) break;
+   }
+
+   while (first < last) {
+      close (fds [first % 256]);
+      first++;
+      watch.files++;
+   }
+   return NULL;
+}
+
+/*------------------------------------------------------------------------------
+ * Read the read/write system call counts of a process.
+ */
+static void processIo (const pid_t pid, unsigned long long* syscr, unsigned long long* syscw)
+{
+   char path [40];
+   char line [120];
+   FILE* file;
+
+   *syscr = 0;
+   *syscw = 0;
+   snprintf (path, sizeof (path), "/proc/%d/io", (int) pid);
+   file = fopen (path, "r");
+   if (!file) return;
+   while (fgets (line, sizeof (line), file)) {
+      sscanf (line, "syscr: %llu", syscr);
+      sscanf (line, "syscw: %llu", syscw);
+   }
+   fclose (file);
+}
+
+/*------------------------------------------------------------------------------
+ */
+static void removeDirectory (const char* directory)
+{
+   DIR* dir = opendir (directory);
+   struct dirent* entry;
+
+   if (dir) {
+      while ((entry = readdir (dir))) {
+         char path [4096];
+         if (strcmp (entry->d_name, ".") == 0 || strcmp (entry->d_name, "..") == 0) continue;
+         snprintf (path, sizeof (path), "%s/%s", directory, entry->d_name);
+         unlink (path);
+      }
+      closedir (dir);
+   }
+   rmdir (directory);
+}
+
+/*------------------------------------------------------------------------------
+ */
+int main (int argc, char** argv)
+{
+   const char* logger = "./rotation_logger";
+   double megabytes = 100.0;
+   int lineSize = 100;
+   int jitter = 0;
+   long rate = 0;
+   int burst = 1;
+   char* directory = NULL;
+   bool temporary = false;
+   char templateName [] = "/tmp/rotation_bench_XXXXXX";
+
+   char* loggerArgs [MAX_LOGGER_ARGS];
+   int numberArgs = 0;
+   char options [400] = "";
+   int pipeFds [2];
+   pid_t pid;
+   pthread_t watcher;
+   char* buffer;
+   unsigned long long target;
+   unsigned long long sent = 0;
+   unsigned long long lines = 0;
+   unsigned long long syscr;
+   unsigned long long syscw;
+   uint64_t start;
+   uint64_t finish;
+   struct rusage usage;
+   siginfo_t info;
+   int status;
+   double seconds;
+   double mb;
+   int j;
+
+   while (true) {
+      static const struct option long_options[] = {
+         {"help", no_argument, NULL, 'h'},
+         {"logger", required_argument, NULL, 'L'},
+         {"mb", required_argument, NULL, 'm'},
+         {"line", required_argument, NULL, 'l'},
+         {"jitter", required_argument, NULL, 'j'},
+         {"rate", required_argument, NULL, 'r'},
+         {"burst", required_argument, NULL, 'b'},
+         {"dir", required_argument, NULL, 'd'},
+         {NULL, 0, NULL, 0}
+      };
+
+      const int c = getopt_long (argc, argv, "hL:m:l:j:r:b:d:", long_options, NULL);
+      if (c == -1)
+         break;
+
+      switch (c) {
+         case 'h':
+            printUsage ();
+            return 0;
+         case 'L':
+            logger = optarg;
+            break;
+         case 'm':
+            megabytes = atof (optarg);
+            break;
+         case 'l':
+            lineSize = atoi (optarg);
+            break;
+         case 'j':
+            jitter = atoi (optarg);
+            break;
+         case 'r':
+            rate = atol (optarg);
+            break;
+         case 'b':
+            burst = atoi (optarg);
+            break;
+         case 'd':
+            directory = optarg;
+            break;
+         default:
+            printUsage ();
+            return 1;
+      }
+   }
+
+   if (lineSize < STAMP_DIGITS + 2) lineSize = STAMP_DIGITS + 2;
+   if (jitter < 0) jitter = 0;
+   if (lineSize - jitter < STAMP_DIGITS + 2) jitter = lineSize - STAMP_DIGITS - 2;
+   if (lineSize + jitter > MAX_LINE_SIZE) jitter = MAX_LINE_SIZE - lineSize;
+   if (burst < 1) burst = 1;
+   if (megabytes <= 0) megabytes = 1;
+   target = megabytes * 1000000.0;
+
+   if (!directory) {
+      directory = mkdtemp (templateName);
+      if (!directory) {
+         perrorf ("mkdtemp (%s)", templateName);
+         return 2;
+      }
+      temporary = true;
+   }
+
+   /* rotation_logger -q [options] directory bench
+    */
+   loggerArgs [numberArgs++] = (char*) logger;
+   loggerArgs [numberArgs++] = "-q";
+   for (j = optind; j < argc && numberArgs < MAX_LOGGER_ARGS - 3; j++) {
+      loggerArgs [numberArgs++] = argv [j];
+      strncat (options, " ", sizeof (options) - strlen (options) - 1);
+      strncat (options, argv [j], sizeof (options) - strlen (options) - 1);
+   }
+   loggerArgs [numberArgs++] = directory;
+   loggerArgs [numberArgs++] = "bench";
+   loggerArgs [numberArgs] = NULL;
+
+   watch.directory = directory;
+   watch.inotifyFd = inotify_init1 (IN_NONBLOCK | IN_CLOEXEC);
+   if (watch.inotifyFd < 0 ||
+       inotify_add_watch (watch.inotifyFd, directory,
+                          IN_CREATE | IN_MOVED_TO | IN_MODIFY) < 0) {
+      perrorf ("inotify (%s)", directory);
+      return 2;
+   }
+   pthread_create (&watcher, NULL, watchThread, NULL);
+
+   if (pipe (pipeFds) != 0) {
+      perrorf ("pipe");
+      return 2;
+   }
+
+   pid = fork ();
+   if (pid < 0) {
+      perrorf ("fork");
+      return 2;
+   }
+   if (pid == 0) {
+      int null = open ("/dev/null", O_WRONLY);
+      dup2 (pipeFds [0], STDIN_FILENO);
+      dup2 (null, STDERR_FILENO);
+      close (pipeFds [0]);
+      close (pipeFds [1]);
+      execvp (logger, loggerArgs);
+      _exit (127);
+   }
+   close (pipeFds [0]);
+   signal (SIGPIPE, SIG_IGN);
+
+   /* Generate the input: bursts of lines, paced so as to meet the rate.
+    */
+   buffer = malloc ((size_t) burst * (lineSize + jitter));
+   if (!buffer) {
+      perrorf ("buffer allocation");
+      return 2;
+   }
+   srandom (1);
+   start = monotonicNs ();
+
+   while (sent < target) {
+      uint64_t now;
+      size_t length = 0;
+      int k;
+
+      if (rate > 0) {
+         const uint64_t due = start + lines * 1000000000ULL / rate;
+         struct timespec ts = { due / 1000000000ULL, due % 1000000000ULL };
+         clock_nanosleep (CLOCK_MONOTONIC, TIMER_ABSTIME, &ts, NULL);
+      }
+
+      now = monotonicNs ();
+      for (k = 0; k < burst && sent + length < target; k++) {
+         int size = lineSize;
+         if (jitter > 0) size += (int) (random () % (2 * jitter + 1)) - jitter;
+         lineFill (buffer + length, size);
+         lineStamp (buffer + length, now);
+         length += size;
+         lines++;
+      }
+
+      if (write (pipeFds [1], buffer, length) != (ssize_t) length) {
+         perrorf ("write to rotation_logger");
+         break;
+      }
+      sent += length;
+   }
+
+   /* Closing the pipe ends the logger, which is left unreaped for now so that
+    * its system call counts can still be read.
+    */
+   close (pipeFds [1]);
+   waitid (P_PID, pid, &info, WEXITED | WNOWAIT);
+   finish = monotonicNs ();
+   processIo (pid, &syscr, &syscw);
+   wait4 (pid, &status, 0, &usage);
+
+   __atomic_store_n (&watch.stop, true, __ATOMIC_RELEASE);
+   pthread_join (watcher, NULL);
+
+   seconds = (finish - start) / 1e9;
+   mb = sent / 1e6;
+
+   printf ("options:%s\n", options[0] ? options : " (none)");
+   printf ("   input:      %.1f MB, %llu lines, %d +/- %d bytes, %d per write, rate %s\n",
+           mb, lines, lineSize, jitter, burst, rate > 0 ? "limited" : "unlimited");
+   printf ("   throughput: %.1f MB/s (%.3f s)\n", mb / seconds, seconds);
+   printf ("   syscalls:   %.1f read + %.1f write per MB\n", syscr / mb, syscw / mb);
+   printf ("   cpu:        %.3f user + %.3f sys s, %ld/%ld context switches\n",
+           usage.ru_utime.tv_sec + usage.ru_utime.tv_usec / 1e6,
+           usage.ru_stime.tv_sec + usage.ru_stime.tv_usec / 1e6,
+           usage.ru_nvcsw, usage.ru_nivcsw);
+
+   if (watch.latency.count == 0) {
+      printf ("   latency:    n/a\n");
+   } else {
+      qsort (watch.latency.values, watch.latency.count, sizeof (uint32_t), sampleCompare);
+      qsort (watch.firstLine.values, watch.firstLine.count, sizeof (uint32_t), sampleCompare);
+      printf ("   latency:    p50 %u  p99 %u  p999 %u  max %u us (%zu lines)\n",
+              percentile (&watch.latency, 50), percentile (&watch.latency, 99),
+              percentile (&watch.latency, 99.9), percentile (&watch.latency, 100),
+              watch.latency.count);
+      printf ("   rotation:   %d files, first line latency p50 %u  max %u us\n",
+              watch.files, percentile (&watch.firstLine, 50),
+              percentile (&watch.firstLine, 100));
+   }
+
+   if (WIFEXITED (status) && WEXITSTATUS (status) != 0) {
+      printf ("   *** %s exited with status %d\n", logger, WEXITSTATUS (status));
+   }
+
+   if (temporary) {
+      removeDirectory (directory);
+   }
+   free (buffer);
+   return 0;
+}
+
+/* end */
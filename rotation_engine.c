@@ -0,0 +1,3287 @@
+/* rotation_engine.c
+ * 
+ * Copyright (C) 2019-2023  Andrew C. Starritt
+ * All rights reserved.
+ *
+ * The rotation logger is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by the
+ * Free Software Foundation, either version 2 of the License.
+ *
+ * You can also redistribute rotation logger and/or modify it under the
+ * terms of the Lesser GNU General Public License as published by the Free
+ * Software Foundation, either version 3 of the License, or (at your option)
+ * any later version when this library is disributed with and as part of the
+ * EPICS QT Framework (https://github.com/qtepics).
+ *
+ * The rotation logger is distributed in the hope that it will be useful, but
+ * WITHOUT ANY WARRANTY; without even the implied warranty of MERCHANTABILITY
+ * or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU General Public License
+ * for more details.
+ *
+ * You should have received a copy of the GNU General Public License and
+ * the Lesser GNU General Public License along with rotation logger.
+ * If not, see <http://www.gnu.org/licenses/>.
+ *
+ * Contact details:
+ * andrew.starritt@gmail.com
+ * PO Box 3118, Prahran East, Victoria 3181, Australia.
+ *
+ */
+
+#define _GNU_SOURCE         /* fallocate, sync_file_range and memrchr */
+
+#include <errno.h>
+#include <dirent.h>
+#include <fcntl.h>
+#include <poll.h>
+#include <pthread.h>
+#include <signal.h>
+#include <stdarg.h>
+#include <stdbool.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <string.h>
+#include <stdlib.h>
+#include <sys/eventfd.h>
+#include <sys/stat.h>
+#include <sys/types.h>
+#include <sys/uio.h>
+#include <time.h>
+#include <unistd.h>
+#include <zlib.h>
+
+#include "rotation_engine.h"
+
+#define FRAME_HEADER     4        /* record length, big endian */
+#define FRAME_RECORD_MAX (64 * 1000 * 1000)
+
+/*------------------------------------------------------------------------------
+ */
+void perrorf (const char* format, ...)
+{
+   char message [240];
+   va_list arguments;
+   va_start (arguments, format);
+   vsnprintf (message, sizeof (message), format, arguments);
+   va_end (arguments);
+   perror (message);
+}
+
+/*------------------------------------------------------------------------------
+ * Credit: Jonathan Leffler
+ * http://stackoverflow.com/questions/675039/how-can-i-create-directory-tree-in-c-linux
+ */
+static bool make_dir (const char* dirpath, const mode_t mode)
+{
+   struct stat st;
+   bool status = true;
+
+   if (stat (dirpath, &st) != 0) {
+      /* Directory does not exist. Test EEXIST for race condition.
+       */
+      if ((mkdir (dirpath, mode) != 0) && (errno != EEXIST)) {
+         status = false;
+         perrorf ("make_dir.1 (%s, 0x%04x)", dirpath, mode);
+      }
+
+   } else if (!S_ISDIR (st.st_mode)) {
+      errno = ENOTDIR;
+      status = false;
+      perrorf ("make_dir.2 (%s, 0x%04x)", dirpath, mode);
+   }
+
+   return status;
+}
+
+/*------------------------------------------------------------------------------
+ */
+static bool mkdir_parents (const char* dirpath, mode_t const mode)
+{
+   char* work_path;
+   char* pp;
+   char* sp;
+   bool status;
+	 
+   if (!dirpath) return false;   /* sainity check */
+   work_path = strdup (dirpath);
+   if (!work_path) return false; /* sainity check */
+
+/* printf ("%s\n", dirpath); */
+   status = true;
+   pp = work_path;
+   while (status && (sp = strchr (pp, '/')) != 0) {
+      if (sp != pp) {
+         /* Neither root nor double slash in path
+          */
+         *sp = '\0';
+         status = make_dir (work_path, mode);
+         *sp = '/';
+      }
+      pp = sp + 1;
+   }
+   if (status) {
+      status = make_dir (dirpath, mode);
+   }
+
+   free (work_path);
+   return status;
+}
+
+/*------------------------------------------------------------------------------
+ * Match text against a date pattern, in which 0 stands for any digit and any
+ * other character stands for itself.
+ */
+static bool dateMatch (const char* text, const char* pattern)
+{
+   for (; *pattern; text++, pattern++) {
+      if (*pattern == '0' ? (*text < '0' || *text > '9') : *text != *pattern) return false;
+   }
+   return true;
+}
+
+/*------------------------------------------------------------------------------
+ * Filter directory entries looking for log files, compressed or otherwise.
+ * The prefix includes the date '_' separator, and prefixLen is its
+ * pre-calculated length. The date part may be any of the name formats; its
+ * length is 19 (seconds), 23 (milliseconds) or 26 (microseconds or sequence).
+ * The date part is checked character by character, so that the files of a
+ * logger whose prefix merely starts with ours, e.g. app_abc, are not taken as
+ * our own.
+ */
+static bool prefixFilter (const char* name, const char* prefix, const size_t prefixLen)
+{
+   size_t dl;
+   size_t datePart;
+
+   if (!name) return false;
+
+   dl = strlen (name);
+/**   printf ("%s  %ld  %ld\n", name, dl, prefixLen);  **/
+   if (strncmp (name, prefix, prefixLen) != 0) return false;
+
+   if (dl > prefixLen + 7 && strcmp (&name [dl - 7], ".log.gz") == 0) {
+      datePart = dl - prefixLen - 7;
+   } else if (dl > prefixLen + 4 && strcmp (&name [dl - 4], ".log") == 0) {
+      datePart = dl - prefixLen - 4;
+   } else {
+      return false;
+   }
+
+   if (!dateMatch (&name [prefixLen], "0000-00-00_00-00-00")) return false;
+
+   switch (datePart) {
+      case 19:
+         return true;
+      case 23:
+         return dateMatch (&name [prefixLen + 19], ".000");
+      case 26:
+         return dateMatch (&name [prefixLen + 19], ".000000") ||
+                dateMatch (&name [prefixLen + 19], "_000000");
+      default:
+         return false;
+   }
+}
+
+/*------------------------------------------------------------------------------
+ * Append an entry (taking ownership of name). Caller must hold the mutex.
+ */
+static bool indexAppend (FileIndex* index, char* name, const int dir, const off_t size,
+                         const time_t mtime)
+{
+   FileEntry* entry;
+
+   if (index->count == index->capacity) {
+      int capacity = index->capacity > 0 ? 2 * index->capacity : 64;
+      FileEntry* entries = malloc (capacity * sizeof (FileEntry));
+      int j;
+
+      if (!entries) {
+         free (name);
+         return false;
+      }
+      for (j = 0; j < index->count; j++) {
+         entries [j] = INDEX_ENTRY (index, j);
+      }
+      free (index->entries);
+      index->entries = entries;
+      index->capacity = capacity;
+      index->first = 0;
+   }
+
+   entry = &INDEX_ENTRY (index, index->count);
+   entry->name = name;
+   entry->dir = dir;
+   entry->size = size;
+   entry->mtime = mtime;
+   index->count++;
+   index->appended++;
+   index->totalSize += size;
+   return true;
+}
+
+/*------------------------------------------------------------------------------
+ * Remove the oldest entry. The name is returned and must be freed by the caller.
+ * Caller must hold the mutex.
+ */
+static char* indexPopFront (FileIndex* index, int* dir)
+{
+   FileEntry* entry;
+
+   if (index->count == 0) return NULL;
+
+   entry = &INDEX_ENTRY (index, 0);
+   if (dir) *dir = entry->dir;
+   index->totalSize -= entry->size;
+   index->first = (index->first + 1) % index->capacity;
+   index->count--;
+   return entry->name;
+}
+
+/*------------------------------------------------------------------------------
+ * Caller must hold the mutex.
+ */
+void indexClear (FileIndex* index)
+{
+   while (index->count > 0) {
+      free (indexPopFront (index, NULL));
+   }
+}
+
+/*------------------------------------------------------------------------------
+ */
+static int entryCompare (const void* a, const void* b)
+{
+   return strcmp (((const FileEntry*) a)->name, ((const FileEntry*) b)->name);
+}
+
+/*------------------------------------------------------------------------------
+ * Add the matching files of one directory to the found list.
+ */
+static bool scanDirectory (const char* directory, const int dirNumber, const char* thePrefix,
+                           FileEntry** found, int* number, int* allocated)
+{
+   const size_t prefixLen = strlen (thePrefix);
+   DIR* dir;
+   struct dirent* entry;
+
+   dir = opendir (directory);
+   if (!dir) {
+      perrorf ("opendir (%s)", directory);
+      return false;
+   }
+
+   while ((entry = readdir (dir)) != NULL) {
+      char fullPath [FULL_PATH_LEN];
+      struct stat st;
+      FileEntry* item;
+
+      if (!prefixFilter (entry->d_name, thePrefix, prefixLen)) continue;
+
+      if (*number == *allocated) {
+         FileEntry* more;
+         const int size = *allocated > 0 ? 2 * *allocated : 64;
+         more = realloc (*found, size * sizeof (FileEntry));
+         if (!more) break;
+         *found = more;
+         *allocated = size;
+      }
+
+      snprintf (fullPath, sizeof (fullPath), "%s/%s", directory, entry->d_name);
+      if (stat (fullPath, &st) != 0) continue;   /* gone already */
+
+      item = &(*found) [*number];
+      item->name = strdup (entry->d_name);
+      item->dir = dirNumber;
+      item->size = st.st_size;
+      item->mtime = st.st_mtime;
+      if (item->name) (*number)++;
+   }
+   closedir (dir);
+   return true;
+}
+
+/*------------------------------------------------------------------------------
+ * Scan the directories, usually just the one, and (re)build the index. The time
+ * stamp format means alphabetical order is chronological order, including that
+ * of files striped across several directories. The directories are read without
+ * holding the mutex, so files added by nextFile meanwhile, which are the newest
+ * entries, may be missing from the scan; such entries are kept.
+ */
+bool indexScan (FileIndex* index, const char* const* directories,
+                const int numberDirectories, const char* prefix)
+{
+   char thePrefix [FULL_PATH_LEN];   /* includes prefix and date '_' separator. */
+   FileEntry* found = NULL;
+   int number = 0;
+   int allocated = 0;
+   unsigned long appended;
+   int newer;
+   int j;
+
+   pthread_mutex_lock (&index->mutex);
+   appended = index->appended;
+   pthread_mutex_unlock (&index->mutex);
+
+   /* Set up prefix - including the under score.
+    */
+   snprintf (thePrefix, sizeof (thePrefix), "%s_", prefix);
+
+   for (j = 0; j < numberDirectories; j++) {
+      if (!scanDirectory (directories [j], j, thePrefix, &found, &number, &allocated)) {
+         while (number > 0) free (found [--number].name);
+         free (found);
+         return false;
+      }
+   }
+
+   qsort (found, number, sizeof (FileEntry), entryCompare);
+
+   pthread_mutex_lock (&index->mutex);
+   newer = index->appended - appended < index->count ? index->appended - appended : index->count;
+   if (number + newer > allocated) {
+      FileEntry* more = realloc (found, (number + newer) * sizeof (FileEntry));
+      if (more) {
+         found = more;
+      } else {
+         newer = 0;
+      }
+   }
+   while (index->count > newer) {
+      free (indexPopFront (index, NULL));
+   }
+   while (index->count > 0) {
+      FileEntry entry = INDEX_ENTRY (index, 0);
+
+      indexPopFront (index, NULL);
+      if (number == 0 || strcmp (entry.name, found [number - 1].name) > 0) {
+         found [number++] = entry;
+      } else {
+         free (entry.name);   /* the scan has it */
+      }
+   }
+   for (j = 0; j < number; j++) {
+      indexAppend (index, found [j].name, found [j].dir, found [j].size, found [j].mtime);
+   }
+   pthread_mutex_unlock (&index->mutex);
+
+   free (found);
+   return true;
+}
+
+/*------------------------------------------------------------------------------
+ */
+unsigned long long monotonicNs ()
+{
+   struct timespec ts;
+   clock_gettime (CLOCK_MONOTONIC, &ts);
+   return ts.tv_sec * 1000000000ULL + ts.tv_nsec;
+}
+
+/*------------------------------------------------------------------------------
+ * The statistics counters, as per Stats.
+ */
+Stats* statsSink = NULL;
+__thread bool statsExcluded = false;
+
+/*------------------------------------------------------------------------------
+ */
+void statsMax (unsigned long long* field, const unsigned long long value)
+{
+   unsigned long long current = __atomic_load_n (field, __ATOMIC_RELAXED);
+   if (statsExcluded) return;
+   while (value > current &&
+          !__atomic_compare_exchange_n (field, &current, value, true,
+                                        __ATOMIC_RELAXED, __ATOMIC_RELAXED)) {
+   }
+}
+
+/*------------------------------------------------------------------------------
+ * The sidecar path for a log file name (with or without directory), i.e. with
+ * the .log or .log.gz suffix replaced by .idx.
+ */
+void timeIndexPath (char* path, const size_t size, const char* name)
+{
+   size_t len;
+
+   snprintf (path, size, "%s", name);
+   len = strlen (path);
+   if (len > 3 && strcmp (&path [len - 3], ".gz") == 0) len -= 3;
+   if (len > 4 && strncmp (&path [len - 4], ".log", 4) == 0) len -= 4;
+   snprintf (path + len, size - len, ".idx");
+}
+
+/*------------------------------------------------------------------------------
+ * Append a record for the given time and file offset.
+ */
+static void timeIndexWrite (LogState* log, const struct timespec* ts, const size_t offset)
+{
+   TimeIndexRecord record;
+
+   record.time = ts->tv_sec * 1000000LL + ts->tv_nsec / 1000;
+   record.offset = offset;
+   if (write (log->timeIndexFd, &record, sizeof (record)) != sizeof (record)) {
+      perrorf ("time index write");
+   }
+   log->timeIndexSecond = ts->tv_sec;
+   log->timeIndexOffset = offset;
+}
+
+/*------------------------------------------------------------------------------
+ * Start the sidecar for a newly created log file, replacing that of the
+ * previous file, or continue that of a resumed file.
+ */
+static void timeIndexOpen (LogState* log, const char* filename, const bool resumed)
+{
+   char path [FULL_PATH_LEN];
+   struct timespec ts;
+
+   if (!log->timeIndex) return;
+
+   if (log->timeIndexFd >= 0) close (log->timeIndexFd);
+   timeIndexPath (path, sizeof (path), filename);
+   log->timeIndexFd = open (path, O_WRONLY | O_CREAT | O_APPEND | (resumed ? 0 : O_TRUNC), 0644);
+   if (log->timeIndexFd < 0) {
+      perrorf ("open(%s,0644)", path);
+      return;
+   }
+   clock_gettime (CLOCK_REALTIME_COARSE, &ts);
+   timeIndexWrite (log, &ts, resumed ? log->total : 0);
+}
+
+/*------------------------------------------------------------------------------
+ * Called before data is written to the current file at offset log->total.
+ */
+void timeIndexNote (LogState* log)
+{
+   struct timespec ts;
+
+   if (log->timeIndexFd < 0) return;
+
+   clock_gettime (CLOCK_REALTIME_COARSE, &ts);
+   if (ts.tv_sec != log->timeIndexSecond ||
+       log->total - log->timeIndexOffset >= TIME_INDEX_SPACING) {
+      timeIndexWrite (log, &ts, log->total);
+   }
+}
+
+/*------------------------------------------------------------------------------
+ */
+static void timeIndexClose (LogState* log)
+{
+   if (log->timeIndexFd >= 0) {
+      close (log->timeIndexFd);
+      log->timeIndexFd = -1;
+   }
+}
+
+/*------------------------------------------------------------------------------
+ * Is the oldest file to be purged? Besides numberToKeep, files are purged while
+ * the total size would exceed maxTotal, allowing for the current file to grow
+ * to the size limit, and when closed for longer than maxAge. The running total
+ * is kept by the index, so no stat of the files is required. The current file,
+ * the newest in the index, is never purged. Caller must hold the index mutex.
+ */
+static bool purgeDue (LogState* log, const int numberToKeep, const time_t now)
+{
+   FileIndex* index = &log->index;
+
+   if (index->count > numberToKeep) return true;
+   if (index->count <= 1) return false;
+
+   if (log->maxTotal > 0 && index->totalSize + log->sizeLimit > log->maxTotal) return true;
+   if (log->maxAge > 0 && INDEX_ENTRY (index, 0).mtime + log->maxAge < now) return true;
+   return false;
+}
+
+/*------------------------------------------------------------------------------
+ * Unlink (delete) all but latest numberToKeep log files, as per the index,
+ * together with any older files due to be purged on size or age.
+ * The entries are removed from the index first so that the unlinks,
+ * which may be slow for large files, are done without holding the mutex.
+ */
+static void purgeOldFiles (LogState* log, const int numberToKeep)
+{
+   const unsigned long long start = monotonicNs ();
+   unsigned long long elapsed;
+   char* purgeList [64];
+   int purgeDirs [64];
+   int n;
+   int j;
+
+   do {
+      const time_t now = time (NULL);
+
+      pthread_mutex_lock (&log->index.mutex);
+      n = 0;
+      while (purgeDue (log, numberToKeep, now) && (n < 64)) {
+         purgeList [n] = indexPopFront (&log->index, &purgeDirs [n]);
+         n++;
+      }
+      pthread_mutex_unlock (&log->index.mutex);
+
+      for (j = 0; j < n; j++) {
+         char fullPath [FULL_PATH_LEN];
+         int status;
+
+         snprintf (fullPath, sizeof (fullPath), "%s/%s", LOG_DIRECTORY (log, purgeDirs [j]),
+                   purgeList [j]);
+/**      printf ("unlinking: %s\n", fullPath);  **/
+         status = unlink (fullPath);
+         if (status < 0 && errno != ENOENT) {
+            perrorf("unlink (%s)", fullPath);
+         } else if (status == 0) {
+            STATS_ADD (purged, 1);
+         }
+         if (log->timeIndex) {
+            char indexPath [FULL_PATH_LEN];
+            timeIndexPath (indexPath, sizeof (indexPath), fullPath);
+            unlink (indexPath);
+         }
+         free (purgeList [j]);
+      }
+   } while (n == 64);
+
+   elapsed = monotonicNs () - start;
+   STATS_ADD (purgeNs, elapsed);
+   STATS_MAX (purgeMaxNs, elapsed);
+}
+
+/*------------------------------------------------------------------------------
+ * The clock used on the data path. The coarse clock is only updated once per
+ * kernel tick, but is read without a system call.
+ */
+static time_t coarseTime ()
+{
+   struct timespec ts;
+   clock_gettime (CLOCK_REALTIME_COARSE, &ts);
+   return ts.tv_sec;
+}
+
+/*------------------------------------------------------------------------------
+ * Update the timestamp image to the current time. The date and time are only
+ * formatted when the second changes; otherwise just the microsecond digits
+ * are patched in place.
+ */
+const char* stampUpdate (Stamp* stamp)
+{
+   struct timespec ts;
+   long micros;
+   int j;
+
+   clock_gettime (CLOCK_REALTIME, &ts);
+   if (ts.tv_sec != stamp->second) {
+      strftime (stamp->image, sizeof (stamp->image), "%Y-%m-%d %H:%M:%S.", localtime (&ts.tv_sec));
+      stamp->image [STAMP_LENGTH - 1] = ' ';
+      stamp->image [STAMP_LENGTH] = '\0';
+      stamp->second = ts.tv_sec;
+   }
+
+   micros = ts.tv_nsec / 1000;
+   for (j = STAMP_LENGTH - 2; j >= STAMP_LENGTH - 7; j--) {
+      stamp->image [j] = '0' + micros % 10;
+      micros /= 10;
+   }
+   return stamp->image;
+}
+
+/*------------------------------------------------------------------------------
+ * Describe the data, with the stamp inserted at the start of each line, as a
+ * gather list of no more than room output bytes, allowing for the newline added
+ * on close after an incomplete line. Each line is found using memchr, and the
+ * data itself is not copied. Whole lines are described where possible; a line
+ * is only split when it is already under way (atLineStart false) or when
+ * canSplit is set, i.e. when the line will not fit into an empty file.
+ * The list may also stop short when full, so the caller must repeat until all
+ * the data is consumed.
+ */
+void stampLines (StampedList* list, const char* stamp, const char* data,
+                 const size_t count, bool atLineStart, const size_t room,
+                 const bool canSplit)
+{
+   list->count = 0;
+   list->consumed = 0;
+   list->length = 0;
+
+   while (list->consumed < count && list->count <= STAMP_IOV_MAX - 2) {
+      const char* start = data + list->consumed;
+      const char* newline = memchr (start, '\n', count - list->consumed);
+      const size_t prefix = atLineStart ? STAMP_LENGTH : 0;
+      size_t length = newline ? newline - start + 1 : count - list->consumed;
+      bool split = false;
+
+      if (room - list->length < prefix + length + (newline ? 0 : 1)) {
+         if (list->length > 0 || (atLineStart && !canSplit) ||
+             room - list->length <= prefix + 1) {
+            break;
+         }
+         length = room - list->length - prefix - 1;
+         split = true;
+      }
+
+      if (prefix > 0) {
+         list->iov [list->count].iov_base = (void*) stamp;
+         list->iov [list->count].iov_len = prefix;
+         list->count++;
+      }
+      list->iov [list->count].iov_base = (void*) start;
+      list->iov [list->count].iov_len = length;
+      list->count++;
+      list->consumed += length;
+      list->length += prefix + length;
+      atLineStart = true;
+
+      if (split) break;
+   }
+}
+
+/*------------------------------------------------------------------------------
+ * 64 bit FNV-1a, continuing from hash.
+ */
+#define FNV_BASIS  0xcbf29ce484222325ULL
+
+static uint64_t dedupHash (uint64_t hash, const char* data, const size_t count)
+{
+   size_t j;
+
+   for (j = 0; j < count; j++) {
+      hash ^= (unsigned char) data [j];
+      hash *= 0x100000001b3ULL;
+   }
+   return hash;
+}
+
+/*------------------------------------------------------------------------------
+ */
+static void dedupRemember (Dedup* dedup, const uint64_t hash, const size_t length)
+{
+   dedup->hashes [dedup->next] = hash;
+   dedup->lengths [dedup->next] = length;
+   dedup->next = (dedup->next + 1) % dedup->window;
+   if (dedup->used < dedup->window) dedup->used++;
+}
+
+/*------------------------------------------------------------------------------
+ */
+static bool dedupSeen (const Dedup* dedup, const uint64_t hash, const size_t length)
+{
+   int j;
+
+   for (j = 0; j < dedup->used; j++) {
+      if (dedup->hashes [j] == hash && dedup->lengths [j] == length) return true;
+   }
+   return false;
+}
+
+/*------------------------------------------------------------------------------
+ * Repeated line suppression. Each complete line is hashed and compared with the
+ * hashes of the last window lines written; a match is suppressed and counted,
+ * to be reported by a summary line. An incomplete line at the end of the data
+ * is held back in the pending buffer, to be compared once complete, unless too
+ * long, in which case it is written as it arrives and not suppressed.
+ * Returns the length of the leading span of data, and what to do with it:
+ *
+ * DEDUP_WRITE     write the span;
+ * DEDUP_PENDING   the span (if any) has been added to the pending buffer, which
+ *                 is to be written and emptied;
+ * DEDUP_SUPPRESS  the span is suppressed, and is counted in repeats;
+ * DEDUP_HOLD      the span has been added to the pending buffer.
+ *
+ * Any summary due must be written by the caller before writing.
+ */
+size_t dedupSpan (Dedup* dedup, const char* data, const size_t count,
+                  enum DedupAction* action)
+{
+   size_t done = 0;
+
+   *action = DEDUP_WRITE;
+
+   if (dedup->pendingLength > 0) {
+      const char* eol = memchr (data, '\n', count);
+      const size_t n = eol ? (size_t) (eol - data) + 1 : count;
+      uint64_t hash;
+
+      if (dedup->pendingLength + n > DEDUP_LINE_MAX) {
+         /* Too long to hold: release what we have, and write the rest as is.
+          */
+         dedup->partialHash = dedupHash (FNV_BASIS, dedup->pending, dedup->pendingLength);
+         dedup->partialLength = dedup->pendingLength;
+         dedup->midLine = true;
+         *action = DEDUP_PENDING;
+         return 0;
+      }
+
+      memcpy (dedup->pending + dedup->pendingLength, data, n);
+      dedup->pendingLength += n;
+      if (!eol) {
+         *action = DEDUP_HOLD;
+         return n;
+      }
+
+      hash = dedupHash (FNV_BASIS, dedup->pending, dedup->pendingLength);
+      if (dedupSeen (dedup, hash, dedup->pendingLength)) {
+         if (dedup->repeats++ == 0) dedup->firstRepeat = coarseTime ();
+         dedup->pendingLength = 0;
+         *action = DEDUP_SUPPRESS;
+      } else {
+         dedupRemember (dedup, hash, dedup->pendingLength);
+         *action = DEDUP_PENDING;
+      }
+      return n;
+   }
+
+   /* The rest of a line already written in part is always written.
+    */
+   if (dedup->midLine) {
+      const char* eol = memchr (data, '\n', count);
+      done = eol ? (size_t) (eol - data) + 1 : count;
+      dedup->partialHash = dedupHash (dedup->partialHash, data, done);
+      dedup->partialLength += done;
+      if (eol) {
+         dedupRemember (dedup, dedup->partialHash, dedup->partialLength);
+         dedup->midLine = false;
+      }
+   }
+
+   while (done < count) {
+      const char* line = data + done;
+      const char* eol = memchr (line, '\n', count - done);
+      uint64_t hash;
+      size_t length;
+      bool seen;
+
+      if (!eol) {
+         if (done > 0) break;   /* held back on the next call */
+
+         if (count <= DEDUP_LINE_MAX) {
+            memcpy (dedup->pending, data, count);
+            dedup->pendingLength = count;
+            dedup->pendingTicked = false;
+            *action = DEDUP_HOLD;
+         } else {
+            dedup->partialHash = dedupHash (FNV_BASIS, data, count);
+            dedup->partialLength = count;
+            dedup->midLine = true;
+         }
+         return count;
+      }
+
+      length = eol - line + 1;
+      hash = dedupHash (FNV_BASIS, line, length);
+      seen = dedupSeen (dedup, hash, length);
+      if (done > 0 && seen == (*action == DEDUP_WRITE)) break;   /* the span ends here */
+
+      if (seen) {
+         *action = DEDUP_SUPPRESS;
+         if (dedup->repeats++ == 0) dedup->firstRepeat = coarseTime ();
+      } else {
+         dedupRemember (dedup, hash, length);
+      }
+      done += length;
+   }
+
+   return done;
+}
+
+/*------------------------------------------------------------------------------
+ * Release any held back incomplete line, which is then continued as written in
+ * part. Returns its length; the caller must write the pending buffer and then
+ * set pendingLength to 0.
+ */
+size_t dedupRelease (Dedup* dedup)
+{
+   if (dedup->pendingLength > 0) {
+      dedup->partialHash = dedupHash (FNV_BASIS, dedup->pending, dedup->pendingLength);
+      dedup->partialLength = dedup->pendingLength;
+      dedup->midLine = true;
+   }
+   return dedup->pendingLength;
+}
+
+/*------------------------------------------------------------------------------
+ * Format the summary of the suppressed lines, if any, and reset the count.
+ * Returns the length of the summary, or 0 if none is due.
+ */
+size_t dedupSummary (Dedup* dedup, char* buffer, const size_t size)
+{
+   int len;
+
+   if (dedup->repeats == 0) return 0;
+
+   if (dedup->window == 1) {
+      len = snprintf (buffer, size, "last message repeated %lu times\n", dedup->repeats);
+   } else {
+      len = snprintf (buffer, size, "%lu repeated lines suppressed\n", dedup->repeats);
+   }
+   dedup->repeats = 0;
+   return len;
+}
+
+/*------------------------------------------------------------------------------
+ * During a long run of repeats, a summary is also due once a second.
+ */
+bool dedupSummaryDue (const Dedup* dedup)
+{
+   return dedup->repeats > 0 && coarseTime () != dedup->firstRepeat;
+}
+
+/*------------------------------------------------------------------------------
+ * Format the date/time part of the next file name.
+ * With the default format, the name has one second resolution and uses the same
+ * clock as the file age, so files at least one second old by age cannot clash by
+ * name. The other formats add milliseconds, microseconds or a sequence number,
+ * and are forced to be strictly increasing so that names never clash, however
+ * rapidly the files are rotated.
+ */
+static void formatFileTime (LogState* log, char* image, const size_t size)
+{
+   struct timespec ts;
+   long long units;
+   int len;
+
+   if (log->nameFormat == NAME_SECONDS) {
+      ts.tv_sec = coarseTime ();
+      strftime (image, size, "%Y-%m-%d_%H-%M-%S", localtime (&ts.tv_sec));
+      return;
+   }
+
+   clock_gettime (CLOCK_REALTIME, &ts);
+
+   switch (log->nameFormat) {
+      case NAME_MILLIS:
+         units = ts.tv_sec * 1000LL + ts.tv_nsec / 1000000;
+         if (units <= log->lastNameUnits) units = log->lastNameUnits + 1;
+         ts.tv_sec = units / 1000;
+         break;
+
+      case NAME_MICROS:
+         units = ts.tv_sec * 1000000LL + ts.tv_nsec / 1000;
+         if (units <= log->lastNameUnits) units = log->lastNameUnits + 1;
+         ts.tv_sec = units / 1000000;
+         break;
+
+      default:   /* NAME_SEQUENCE - units are seconds, with the sequence number */
+         if (ts.tv_sec <= log->lastNameUnits) {
+            ts.tv_sec = log->lastNameUnits;
+            log->sequence++;
+         } else {
+            log->sequence = 0;
+         }
+         units = ts.tv_sec;
+         break;
+   }
+   log->lastNameUnits = units;
+
+   len = strftime (image, size, "%Y-%m-%d_%H-%M-%S", localtime (&ts.tv_sec));
+   switch (log->nameFormat) {
+      case NAME_MILLIS:
+         snprintf (image + len, size - len, ".%03d", (int) (units % 1000));
+         break;
+      case NAME_MICROS:
+         snprintf (image + len, size - len, ".%06d", (int) (units % 1000000));
+         break;
+      default:
+         snprintf (image + len, size - len, "_%06d", log->sequence);
+         break;
+   }
+}
+
+/*------------------------------------------------------------------------------
+ * Reserve disk space for the whole file up front, without changing the file
+ * size, so that the file is laid out contiguously rather than extended one
+ * write at a time. Any unused space is released when the file is closed.
+ */
+static void preallocateFile (LogState* log, const int fd)
+{
+   if (!log->preallocate) return;
+
+   if (fallocate (fd, FALLOC_FL_KEEP_SIZE, 0, log->sizeLimit) != 0) {
+      if (errno == EOPNOTSUPP || errno == ENOSYS) {
+         perrorf ("fallocate, preallocation disabled");
+         log->preallocate = false;
+      } else {
+         perrorf ("fallocate (%ld)", log->sizeLimit);
+      }
+   }
+}
+
+/*------------------------------------------------------------------------------
+ * The directory number for the next file: when striping, the one after that of
+ * the current file.
+ */
+static int nextDirectory (const LogState* log)
+{
+   return (log->directoryNumber + 1) % log->numberDirectories;
+}
+
+/*------------------------------------------------------------------------------
+ * The hidden name of the pre-created file in the given directory.
+ */
+static void sparePath (const LogState* log, const int dir, char* path, const size_t size)
+{
+   snprintf (path, size, "%s/.%s_next.log", LOG_DIRECTORY (log, dir), log->prefix);
+}
+
+/*------------------------------------------------------------------------------
+ * When striping, each new file goes in the next directory in turn, spreading the
+ * write bandwidth across the disks. A pre-created file decides the directory.
+ */
+int nextFile (LogState* log)
+{
+   time_t timeNow;
+   char timeImage [40];
+   char filename [FULL_PATH_LEN];
+   const char* directory;
+   char* name;
+   int dir;
+   int fd;
+
+   /* If a file has been pre-created, just give it its proper name.
+    */
+   fd = __atomic_exchange_n (&log->spareFd, -1, __ATOMIC_ACQ_REL);
+   dir = fd >= 0 ? log->spareDirectory : nextDirectory (log);
+   directory = LOG_DIRECTORY (log, dir);
+
+   timeNow = coarseTime ();
+   formatFileTime (log, timeImage, sizeof (timeImage));
+   snprintf (filename,  sizeof (filename),  "%s/%s_%s.log%s", directory, log->prefix,
+             timeImage, log->gzip ? ".gz" : "");
+
+   log->precreatePending = false;
+   log->lastTime = timeNow;
+   log->directoryNumber = dir;
+   if (fd >= 0) {
+      char spare [FULL_PATH_LEN];
+
+      sparePath (log, dir, spare, sizeof (spare));
+      if (rename (spare, filename) != 0) {
+         perrorf ("rename (%s,%s)", spare, filename);
+         close (fd);
+         fd = -1;
+      }
+   }
+
+   /* Open read/write (unlike creat) so that the last character written
+    * can be recovered when data is spliced into the file.
+    */
+   if (fd < 0) {
+      fd = open (filename, O_RDWR | O_CREAT | O_TRUNC, 0644);
+      if (fd >= 0) preallocateFile (log, fd);
+   }
+   if (fd < 0) {
+      perrorf ("open(%s,0644)", filename);
+      return fd;
+   }
+/**   printf ("new log file: %s\n", filename); **/
+   timeIndexOpen (log, filename, false);
+
+   name = strdup (filename + strlen (directory) + 1);
+   if (name) {
+      pthread_mutex_lock (&log->index.mutex);
+      if ((log->index.count > 0) &&
+          (strcmp (INDEX_ENTRY (&log->index, log->index.count - 1).name, name) == 0)) {
+         free (name);   /* already picked up by a re-sync */
+      } else {
+         indexAppend (&log->index, name, dir, 0, timeNow);
+      }
+      pthread_mutex_unlock (&log->index.mutex);
+   }
+
+   return fd;
+}
+
+/*------------------------------------------------------------------------------
+ * Parse the date/time part of a log file name (without directory, compressed
+ * or otherwise) in the current name format, giving the time and the
+ * milliseconds, microseconds or sequence number.
+ */
+static bool parseNameTime (const LogState* log, const char* name, time_t* nameTime,
+                           long* fraction)
+{
+   static const size_t dateLength [] = { 19, 23, 26, 26 };   /* as per NameFormat */
+   const size_t prefixLen = strlen (log->prefix) + 1;
+   size_t len = strlen (name);
+   char datePart [40];
+   struct tm tm;
+   const char* end;
+
+   if (len > 3 && strcmp (&name [len - 3], ".gz") == 0) len -= 3;
+   if (len < prefixLen + 4 || strncmp (&name [len - 4], ".log", 4) != 0 ||
+       len - prefixLen - 4 != dateLength [log->nameFormat]) {
+      return false;
+   }
+   snprintf (datePart, sizeof (datePart), "%.*s", (int) (len - prefixLen - 4), name + prefixLen);
+
+   memset (&tm, 0, sizeof (tm));
+   end = strptime (datePart, "%Y-%m-%d_%H-%M-%S", &tm);
+   if (!end) return false;
+   *fraction = 0;
+   if (log->nameFormat == NAME_MILLIS || log->nameFormat == NAME_MICROS) {
+      if (*end != '.') return false;
+      *fraction = atol (end + 1);
+   } else if (log->nameFormat == NAME_SEQUENCE) {
+      if (*end != '_') return false;
+      *fraction = atol (end + 1);
+   }
+   tm.tm_isdst = -1;
+   *nameTime = mktime (&tm);
+   return true;
+}
+
+/*------------------------------------------------------------------------------
+ * Keep the names of following files strictly increasing from that of the given
+ * file, e.g. the newest file of an earlier run, so that a new file never
+ * replaces it, however soon after it the new file is created.
+ */
+static void seedNameUnits (LogState* log, const time_t nameTime, const long fraction)
+{
+   switch (log->nameFormat) {
+      case NAME_MILLIS:
+         log->lastNameUnits = nameTime * 1000LL + fraction;
+         break;
+      case NAME_MICROS:
+         log->lastNameUnits = nameTime * 1000000LL + fraction;
+         break;
+      case NAME_SEQUENCE:
+         log->lastNameUnits = nameTime;
+         log->sequence = fraction;
+         break;
+      default:
+         break;
+   }
+}
+
+/*------------------------------------------------------------------------------
+ * Reopen the newest file from the directory scan, if it is an uncompressed file
+ * with the current name format and within the size and age limits, positioned
+ * at its end, instead of starting a new file. The age is taken from the time in
+ * the name. The file is not opened with O_APPEND, as splice(2) does not allow it
+ * and the io_uring backend writes at explicit offsets.
+ * Returns the file descriptor, or -1 if a new file is required.
+ */
+static int resumeFile (LogState* log)
+{
+   char filename [FULL_PATH_LEN];
+   const char* name = NULL;
+   struct stat st;
+   time_t nameTime;
+   long fraction = 0;
+   size_t len;
+   int dir = 0;
+   int fd;
+
+   pthread_mutex_lock (&log->index.mutex);
+   if (log->index.count > 0) {
+      const FileEntry* entry = &INDEX_ENTRY (&log->index, log->index.count - 1);
+      name = entry->name;
+      dir = entry->dir;
+      snprintf (filename, sizeof (filename), "%s/%s", LOG_DIRECTORY (log, dir), name);
+      len = strlen (name);
+   }
+   pthread_mutex_unlock (&log->index.mutex);
+
+   if (!name || log->gzip || strcmp (&name [len - 4], ".log") != 0 ||
+       !parseNameTime (log, name, &nameTime, &fraction)) {
+      return -1;
+   }
+
+   fd = open (filename, O_RDWR);
+   if (fd < 0) {
+      perrorf ("open(%s)", filename);
+      return -1;
+   }
+   if (fstat (fd, &st) != 0 || st.st_size >= log->sizeLimit ||
+       coarseTime () - nameTime >= log->ageLimit || lseek (fd, 0, SEEK_END) < 0) {
+      close (fd);
+      return -1;
+   }
+
+   log->lastTime = nameTime;
+   log->directoryNumber = dir;
+   log->total = st.st_size;
+   log->last_char = '\n';
+   if (st.st_size > 0 && pread (fd, &log->last_char, 1, st.st_size - 1) != 1) {
+      log->last_char = '\n';
+   }
+
+   seedNameUnits (log, nameTime, fraction);
+   preallocateFile (log, fd);
+   timeIndexOpen (log, filename, true);
+   fprintf (stderr, "resuming %s\n", filename);
+   return fd;
+}
+
+/*------------------------------------------------------------------------------
+ * Record the final size of the current (i.e. newest) file.
+ * Returns a copy of its name, which the caller must free, or NULL.
+ */
+static char* indexUpdateCurrent (LogState* log, int* dir)
+{
+   char* name = NULL;
+
+   pthread_mutex_lock (&log->index.mutex);
+   if (log->index.count > 0) {
+      FileEntry* entry = &INDEX_ENTRY (&log->index, log->index.count - 1);
+      const off_t size = log->gzip ? log->compressedTotal : log->total;
+      log->index.totalSize += size - entry->size;
+      entry->size = size;
+      time (&entry->mtime);
+      name = strdup (entry->name);
+      *dir = entry->dir;
+   }
+   pthread_mutex_unlock (&log->index.mutex);
+
+   return name;
+}
+
+/*------------------------------------------------------------------------------
+ * Background reaper.
+ * Retention (unlink of the old files) can take a long time when the files are
+ * large, so it is done by a separate thread. The rotation path just queues a
+ * request and signals the reaper. The reaper also periodically re-synchronises
+ * the index of registered logs with the directory, so that externally deleted
+ * or added files are accounted for.
+ */
+static struct {
+   pthread_t thread;
+   pthread_mutex_t mutex;
+   pthread_cond_t wake;
+   pthread_cond_t idle;
+   LogState* queue;
+   LogState* resyncLog;
+   LogState* current;            /* being processed */
+   bool running;
+   bool shutdown;
+} reaper = { .mutex = PTHREAD_MUTEX_INITIALIZER, .wake = PTHREAD_COND_INITIALIZER,
+             .idle = PTHREAD_COND_INITIALIZER };
+
+/*------------------------------------------------------------------------------
+ * Add log to the reaper queue if not already there. Caller must hold the mutex.
+ */
+static void reaperQueue (LogState* log)
+{
+   if (!log->reaperQueued) {
+      log->reaperQueued = true;
+      log->reaperNext = reaper.queue;
+      reaper.queue = log;
+      pthread_cond_signal (&reaper.wake);
+   }
+}
+
+/*------------------------------------------------------------------------------
+ * Create the next file ahead of time under a hidden name, so that rotation only
+ * involves a rename and a file descriptor swap.
+ */
+static void precreateFile (LogState* log)
+{
+   char path [FULL_PATH_LEN];
+   int expected = -1;
+   int dir;
+   int fd;
+
+   if (__atomic_load_n (&log->spareFd, __ATOMIC_ACQUIRE) >= 0) return;   /* already have one */
+
+   dir = nextDirectory (log);
+   sparePath (log, dir, path, sizeof (path));
+   fd = open (path, O_RDWR | O_CREAT | O_TRUNC, 0644);
+   if (fd < 0) {
+      perrorf ("open(%s,0644)", path);
+      return;
+   }
+   preallocateFile (log, fd);
+   log->spareDirectory = dir;   /* published by the exchange */
+
+   if (!__atomic_compare_exchange_n (&log->spareFd, &expected, fd, false,
+                                     __ATOMIC_ACQ_REL, __ATOMIC_ACQUIRE)) {
+      close (fd);
+   }
+}
+
+/*------------------------------------------------------------------------------
+ * Commit a closed file to disk and close it. In write-behind mode most of the
+ * data is already written back, so this only waits for the remainder.
+ */
+static void syncClose (const enum SyncMode mode, const int fd)
+{
+   const unsigned long long start = monotonicNs ();
+   unsigned long long elapsed;
+
+   if (mode == SYNC_WRITEBEHIND) {
+      if (sync_file_range (fd, 0, 0, SYNC_FILE_RANGE_WAIT_BEFORE | SYNC_FILE_RANGE_WRITE |
+                                     SYNC_FILE_RANGE_WAIT_AFTER) != 0) {
+         perrorf ("sync_file_range");
+      }
+   } else if (fdatasync (fd) != 0) {
+      perrorf ("fdatasync");
+   }
+   close (fd);
+
+   elapsed = monotonicNs () - start;
+   STATS_ADD (syncs, 1);
+   STATS_ADD (syncNs, elapsed);
+   STATS_MAX (syncMaxNs, elapsed);
+}
+
+/*------------------------------------------------------------------------------
+ */
+static void* reaperThread (void* arg)
+{
+   pthread_mutex_lock (&reaper.mutex);
+   while (true) {
+      LogState* log;
+      bool doPurge;
+      bool doPrecreate;
+      ClosingFile* closing;
+
+      while (!reaper.queue && !reaper.shutdown) {
+         LogState* resync = reaper.resyncLog;
+         if (resync && resync->resyncPeriod > 0) {
+            struct timespec deadline;
+            int status;
+
+            deadline.tv_sec = resync->lastResync + resync->resyncPeriod;
+            deadline.tv_nsec = 0;
+            status = pthread_cond_timedwait (&reaper.wake, &reaper.mutex, &deadline);
+            if (status == ETIMEDOUT) {
+               pthread_mutex_unlock (&reaper.mutex);
+               indexScan (&resync->index, resync->stripe ? resync->stripe : &resync->directory,
+                          resync->numberDirectories, resync->prefix);
+               time (&resync->lastResync);
+               pthread_mutex_lock (&reaper.mutex);
+               resync->purgeRequested = true;
+               reaperQueue (resync);
+            }
+         } else {
+            pthread_cond_wait (&reaper.wake, &reaper.mutex);
+         }
+      }
+      if (!reaper.queue) break;   /* shutdown and nothing pending */
+
+      log = reaper.queue;
+      reaper.queue = log->reaperNext;
+      log->reaperNext = NULL;
+      log->reaperQueued = false;
+      doPurge = log->purgeRequested;
+      doPrecreate = log->precreateRequested;
+      closing = log->closingHead;
+      log->purgeRequested = false;
+      log->precreateRequested = false;
+      log->closingHead = NULL;
+      log->closingTail = NULL;
+      reaper.current = log;
+      pthread_mutex_unlock (&reaper.mutex);
+
+      while (closing) {
+         ClosingFile* next = closing->next;
+         syncClose (log->syncMode, closing->fd);
+         free (closing);
+         closing = next;
+      }
+
+      if (doPrecreate) {
+         precreateFile (log);
+      }
+
+      /* The index includes the current file, so keep one more than numberToKeep.
+       */
+      if (doPurge) {
+         purgeOldFiles (log, log->numberToKeep + 1);
+      }
+
+      pthread_mutex_lock (&reaper.mutex);
+      reaper.current = NULL;
+      pthread_cond_broadcast (&reaper.idle);
+   }
+   pthread_mutex_unlock (&reaper.mutex);
+
+   return NULL;
+}
+
+/*------------------------------------------------------------------------------
+ * The directory of the resync log, if any, is re-scanned every resyncPeriod secs.
+ */
+void reaperStart (LogState* resyncLog)
+{
+   int status;
+
+   if (resyncLog) time (&resyncLog->lastResync);
+   reaper.resyncLog = resyncLog;
+   reaper.shutdown = false;
+
+   status = pthread_create (&reaper.thread, NULL, reaperThread, NULL);
+   if (status != 0) {
+      errno = status;
+      perrorf ("pthread_create (reaper)");
+      return;   /* purge requests will be handled synchronously */
+   }
+   reaper.running = true;
+}
+
+/*------------------------------------------------------------------------------
+ * Waits for any outstanding purge, pre-create and sync requests to complete.
+ */
+void reaperStop ()
+{
+   if (!reaper.running) return;
+
+   pthread_mutex_lock (&reaper.mutex);
+   reaper.shutdown = true;
+   pthread_cond_signal (&reaper.wake);
+   pthread_mutex_unlock (&reaper.mutex);
+
+   pthread_join (reaper.thread, NULL);
+   reaper.running = false;
+}
+
+/*------------------------------------------------------------------------------
+ * Wait until the reaper has no outstanding requests for the log, so that it may
+ * be freed while the reaper continues to serve other logs.
+ */
+static void reaperRelease (LogState* log)
+{
+   pthread_mutex_lock (&reaper.mutex);
+   while (reaper.running && (log->reaperQueued || reaper.current == log)) {
+      pthread_cond_wait (&reaper.idle, &reaper.mutex);
+   }
+   pthread_mutex_unlock (&reaper.mutex);
+}
+
+/*------------------------------------------------------------------------------
+ * Request that all but latest numberToKeep old log files be unlinked (deleted).
+ * A request for a log that is already queued is merged with the queued request.
+ */
+void requestPurge (LogState* log)
+{
+   if (!reaper.running) {
+      purgeOldFiles (log, log->numberToKeep + 1);
+      return;
+   }
+
+   pthread_mutex_lock (&reaper.mutex);
+   log->purgeRequested = true;
+   reaperQueue (log);
+   pthread_mutex_unlock (&reaper.mutex);
+}
+
+/*------------------------------------------------------------------------------
+ * Request that the next file be pre-created.
+ */
+static void requestPrecreate (LogState* log)
+{
+   log->precreatePending = true;
+
+   if (!reaper.running) {
+      precreateFile (log);
+      return;
+   }
+
+   pthread_mutex_lock (&reaper.mutex);
+   log->precreateRequested = true;
+   reaperQueue (log);
+   pthread_mutex_unlock (&reaper.mutex);
+}
+
+/*------------------------------------------------------------------------------
+ * Request that a closed file be synced and then closed, so that neither the
+ * sync nor the writeback of its remaining dirty pages delays the data path.
+ * Files closed while the reaper is still syncing earlier ones are queued behind
+ * them and synced in order.
+ */
+static void requestSyncClose (LogState* log, const int fd)
+{
+   ClosingFile* closing = reaper.running ? malloc (sizeof (ClosingFile)) : NULL;
+
+   if (!closing) {
+      syncClose (log->syncMode, fd);
+      return;
+   }
+   closing->next = NULL;
+   closing->fd = fd;
+
+   pthread_mutex_lock (&reaper.mutex);
+   if (log->closingTail) {
+      log->closingTail->next = closing;
+   } else {
+      log->closingHead = closing;
+   }
+   log->closingTail = closing;
+   reaperQueue (log);
+   pthread_mutex_unlock (&reaper.mutex);
+}
+
+/*------------------------------------------------------------------------------
+ * Close and remove any unused pre-created file.
+ */
+static void discardSpare (LogState* log)
+{
+   int fd = __atomic_exchange_n (&log->spareFd, -1, __ATOMIC_ACQ_REL);
+   if (fd >= 0) {
+      char path [FULL_PATH_LEN];
+
+      sparePath (log, log->spareDirectory, path, sizeof (path));
+      close (fd);
+      unlink (path);
+   }
+}
+
+/*------------------------------------------------------------------------------
+ * Background compression.
+ * Closed log files are queued and gzip compressed by a pool of worker threads,
+ * so that a burst of rotations is compressed in parallel and the data path
+ * never waits on compression. The compressed file, <name>.log.gz, replaces the
+ * original both on disk and in the index.
+ */
+typedef struct CompressJob {
+   struct CompressJob* next;
+   LogState* log;
+   char* name;                   /* filename only, i.e. no directory */
+   int dir;
+} CompressJob;
+
+static struct {
+   pthread_t threads [MAX_COMPRESS_THREADS];
+   int number;
+   pthread_mutex_t mutex;
+   pthread_cond_t wake;
+   pthread_cond_t done;
+   CompressJob* head;
+   CompressJob* tail;
+   bool shutdown;
+} compressor = { .mutex = PTHREAD_MUTEX_INITIALIZER, .wake = PTHREAD_COND_INITIALIZER,
+                 .done = PTHREAD_COND_INITIALIZER };
+
+/*------------------------------------------------------------------------------
+ * Compress source into target. Returns false on failure.
+ */
+static bool gzipFile (const char* source, const char* target)
+{
+   char buffer [RING_BUFFER_SIZE];
+   gzFile gz;
+   int fd;
+   ssize_t n;
+   bool status = true;
+
+   fd = open (source, O_RDONLY);
+   if (fd < 0) {
+      if (errno != ENOENT) perrorf ("open (%s)", source);
+      return false;
+   }
+
+   gz = gzopen (target, "wb6");
+   if (!gz) {
+      perrorf ("gzopen (%s)", target);
+      close (fd);
+      return false;
+   }
+
+   while ((n = read (fd, buffer, sizeof (buffer))) != 0) {
+      if (n < 0) {
+         if (errno == EINTR) continue;
+         perrorf ("read (%s)", source);
+         status = false;
+         break;
+      }
+      if (gzwrite (gz, buffer, n) != n) {
+         perrorf ("gzwrite (%s)", target);
+         status = false;
+         break;
+      }
+   }
+
+   if (gzclose (gz) != Z_OK) {
+      status = false;
+   }
+   close (fd);
+
+   if (!status) unlink (target);
+   return status;
+}
+
+/*------------------------------------------------------------------------------
+ * Compress one closed file and swap the compressed file into the index.
+ * If the entry has been purged from the index in the mean time, the
+ * compressed file is discarded.
+ */
+static void compressOne (LogState* log, const int dir, const char* name)
+{
+   char source [FULL_PATH_LEN];
+   char target [FULL_PATH_LEN + 8];
+   char partial [FULL_PATH_LEN + 16];
+   struct stat st;
+   bool found = false;
+   int j;
+
+   snprintf (source, sizeof (source), "%s/%s", LOG_DIRECTORY (log, dir), name);
+   snprintf (target, sizeof (target), "%s.gz", source);
+   snprintf (partial, sizeof (partial), "%s.gz.part", source);
+
+   if (!gzipFile (source, partial)) return;
+
+   if (stat (partial, &st) != 0 || rename (partial, target) != 0) {
+      perrorf ("rename (%s)", partial);
+      unlink (partial);
+      return;
+   }
+
+   pthread_mutex_lock (&log->index.mutex);
+   for (j = log->index.count - 1; j >= 0; j--) {
+      FileEntry* entry = &INDEX_ENTRY (&log->index, j);
+      if (entry->dir == dir && strcmp (entry->name, name) == 0) {
+         char* gzName = malloc (strlen (name) + 4);
+         if (gzName) {
+            sprintf (gzName, "%s.gz", name);
+            free (entry->name);
+            entry->name = gzName;
+            log->index.totalSize += st.st_size - entry->size;
+            entry->size = st.st_size;
+            found = true;
+         }
+         break;
+      }
+   }
+   pthread_mutex_unlock (&log->index.mutex);
+
+   /* Either the original has gone from the index and the compressed file is
+    * surplus, or the compressed file is now the indexed one.
+    */
+   unlink (found ? source : target);
+}
+
+/*------------------------------------------------------------------------------
+ */
+static void* compressThread (void* arg)
+{
+   pthread_mutex_lock (&compressor.mutex);
+   while (true) {
+      CompressJob* job;
+
+      while (!compressor.head && !compressor.shutdown) {
+         pthread_cond_wait (&compressor.wake, &compressor.mutex);
+      }
+      if (!compressor.head) break;   /* shutdown and nothing pending */
+
+      job = compressor.head;
+      compressor.head = job->next;
+      if (!compressor.head) compressor.tail = NULL;
+      pthread_mutex_unlock (&compressor.mutex);
+
+      compressOne (job->log, job->dir, job->name);
+
+      pthread_mutex_lock (&compressor.mutex);
+      job->log->compressPending--;
+      pthread_cond_broadcast (&compressor.done);
+      free (job->name);
+      free (job);
+   }
+   pthread_mutex_unlock (&compressor.mutex);
+
+   return NULL;
+}
+
+/*------------------------------------------------------------------------------
+ */
+void compressorStart (const int number)
+{
+   int j;
+
+   compressor.shutdown = false;
+   for (j = 0; j < number && j < MAX_COMPRESS_THREADS; j++) {
+      int status = pthread_create (&compressor.threads [j], NULL, compressThread, NULL);
+      if (status != 0) {
+         errno = status;
+         perrorf ("pthread_create (compressor)");
+         break;
+      }
+      compressor.number++;
+   }
+}
+
+/*------------------------------------------------------------------------------
+ * Waits for all queued files to be compressed.
+ */
+void compressorStop ()
+{
+   int j;
+
+   pthread_mutex_lock (&compressor.mutex);
+   compressor.shutdown = true;
+   pthread_cond_broadcast (&compressor.wake);
+   pthread_mutex_unlock (&compressor.mutex);
+
+   for (j = 0; j < compressor.number; j++) {
+      pthread_join (compressor.threads [j], NULL);
+   }
+   compressor.number = 0;
+}
+
+/*------------------------------------------------------------------------------
+ * Queue a closed file for compression. Takes ownership of name.
+ */
+static void requestCompress (LogState* log, const int dir, char* name)
+{
+   CompressJob* job;
+
+   if (compressor.number == 0) {
+      free (name);
+      return;
+   }
+
+   job = malloc (sizeof (CompressJob));
+   if (!job) {
+      free (name);
+      return;
+   }
+   job->next = NULL;
+   job->log = log;
+   job->name = name;
+   job->dir = dir;
+
+   pthread_mutex_lock (&compressor.mutex);
+   if (compressor.tail) {
+      compressor.tail->next = job;
+   } else {
+      compressor.head = job;
+   }
+   compressor.tail = job;
+   log->compressPending++;
+   pthread_cond_signal (&compressor.wake);
+   pthread_mutex_unlock (&compressor.mutex);
+}
+
+/*------------------------------------------------------------------------------
+ * Wait until all the files queued for the log have been compressed.
+ */
+static void compressorRelease (LogState* log)
+{
+   pthread_mutex_lock (&compressor.mutex);
+   while (log->compressPending > 0) {
+      pthread_cond_wait (&compressor.done, &compressor.mutex);
+   }
+   pthread_mutex_unlock (&compressor.mutex);
+}
+
+/*------------------------------------------------------------------------------
+ * Queue any uncompressed files left over from a previous run.
+ * Called on startup, before the first file is created, or once a file is
+ * resumed, in which case the resumed (newest) file is excluded.
+ */
+static void compressExisting (LogState* log)
+{
+   int number;
+   int j;
+
+   pthread_mutex_lock (&log->index.mutex);
+   number = log->index.count - (log->fd >= 0 ? 1 : 0);
+   for (j = 0; j < number; j++) {
+      const char* name = INDEX_ENTRY (&log->index, j).name;
+      size_t dl = strlen (name);
+      if (strcmp (&name [dl - 4], ".log") == 0) {
+         char* copy = strdup (name);
+         if (copy) requestCompress (log, INDEX_ENTRY (&log->index, j).dir, copy);
+      }
+   }
+   pthread_mutex_unlock (&log->index.mutex);
+}
+
+/*------------------------------------------------------------------------------
+ * Write all of the data, retrying after partial writes.
+ * Returns the number of bytes written, which is less than count on error.
+ */
+size_t writeAll (const int fd, const void* data, const size_t count)
+{
+   size_t done = 0;
+
+   while (done < count) {
+      ssize_t n = write (fd, (const char*) data + done, count - done);
+      STATS_ADD (writes, 1);
+      if (n < 0 && errno == EINTR)
+         continue;
+      if (n <= 0)
+         break;
+      done += n;
+   }
+   return done;
+}
+
+/*------------------------------------------------------------------------------
+ * As writeAll, but for a gather list. The list is updated after a partial write.
+ */
+size_t writevAll (const int fd, struct iovec* iov, int count)
+{
+   size_t done = 0;
+
+   while (count > 0) {
+      ssize_t n = writev (fd, iov, count);
+      STATS_ADD (writes, 1);
+      if (n < 0 && errno == EINTR)
+         continue;
+      if (n <= 0)
+         break;
+      done += n;
+
+      while (count > 0 && (size_t) n >= iov->iov_len) {
+         n -= iov->iov_len;
+         iov++;
+         count--;
+      }
+      if (count > 0) {
+         iov->iov_base = (char*) iov->iov_base + n;
+         iov->iov_len -= n;
+      }
+   }
+   return done;
+}
+
+/*------------------------------------------------------------------------------
+ * Streaming gzip output.
+ * In this mode the active file is itself a gzip stream. The stream is sync
+ * flushed at most once per second (so that the file may be followed using, say,
+ * zcat), and each file is concluded as a complete gzip member on close.
+ * Returns false on a compression or write error.
+ */
+static bool gzipDeflate (LogState* log, const int flush)
+{
+   int status;
+
+   do {
+      size_t have;
+
+      log->zs.next_out = log->zbuffer;
+      log->zs.avail_out = GZIP_BUFFER_SIZE;
+      status = deflate (&log->zs, flush);
+      if (status == Z_STREAM_ERROR) return false;
+
+      have = GZIP_BUFFER_SIZE - log->zs.avail_out;
+      if (have > 0) {
+         size_t n = writeAll (log->fd, log->zbuffer, have);
+         log->compressedTotal += n;
+         if (n != have) return false;
+      }
+   } while (log->zs.avail_out == 0);
+
+   return true;
+}
+
+/*------------------------------------------------------------------------------
+ */
+static bool gzipWrite (LogState* log, const char* data, const size_t count)
+{
+   time_t timeNow;
+   bool status;
+
+   log->zs.next_in = (Bytef*) data;
+   log->zs.avail_in = count;
+   status = gzipDeflate (log, Z_NO_FLUSH);
+   log->unflushed = true;
+
+   timeNow = coarseTime ();
+   if (status && timeNow != log->lastFlush) {
+      status = gzipDeflate (log, Z_SYNC_FLUSH);
+      log->lastFlush = timeNow;
+      log->unflushed = false;
+   }
+
+   return status;
+}
+
+/*------------------------------------------------------------------------------
+ * Write data to the current file, compressing if required.
+ * Returns the number of (uncompressed) bytes written, or -1.
+ */
+static int fileWrite (LogState* log, const char* data, const size_t count)
+{
+   timeIndexNote (log);
+   if (log->gzip) {
+      return gzipWrite (log, data, count) ? (int) count : -1;
+   }
+   STATS_ADD (writes, 1);
+   return write (log->fd, data, count);
+}
+
+/*------------------------------------------------------------------------------
+ * As fileWrite, for a gather list.
+ * Returns the number of (uncompressed) bytes written, which is less than the
+ * total length of the list on error.
+ */
+static size_t fileWritev (LogState* log, struct iovec* iov, const int count)
+{
+   size_t done = 0;
+   int j;
+
+   timeIndexNote (log);
+   if (!log->gzip) {
+      return writevAll (log->fd, iov, count);
+   }
+
+   for (j = 0; j < count; j++) {
+      if (!gzipWrite (log, iov [j].iov_base, iov [j].iov_len)) break;
+      done += iov [j].iov_len;
+   }
+   return done;
+}
+
+/*------------------------------------------------------------------------------
+ * The size as compared with the size limit.
+ */
+static size_t fileSize (const LogState* log)
+{
+   return (log->gzip && log->sizeCompressed) ? log->compressedTotal : log->total;
+}
+
+/*------------------------------------------------------------------------------
+ * The size the file will be once closed, i.e. including any newline added
+ * by fileClose (which is not known for compressed sizes).
+ */
+static size_t closedSize (const LogState* log)
+{
+   size_t size = fileSize (log);
+
+   if (!(log->gzip && log->sizeCompressed) && !log->lastCharUnknown &&
+       log->total > 0 && log->last_char != '\n') {
+      size++;
+   }
+   return size;
+}
+
+/*------------------------------------------------------------------------------
+ * Durability. With SYNC_PERIODIC, written data is committed with fdatasync once
+ * syncInterval ms have elapsed or syncBytes have accumulated since the last
+ * sync, so that many writes share one sync (group commit). With SYNC_WRITEBEHIND,
+ * writeback of the new data is started with sync_file_range and we wait for the
+ * writeback started last time, which keeps the dirty data bounded and the disk
+ * busy steadily rather than in bursts. Note sync_file_range does not commit the
+ * file metadata or flush the disk cache.
+ */
+void logSync (LogState* log)
+{
+   const size_t offset = log->gzip ? log->compressedTotal : log->total;
+   unsigned long long now;
+   unsigned long long elapsed;
+   size_t pending;
+
+   if (log->syncMode == SYNC_NONE || log->fd < 0 || offset <= log->syncedOffset) return;
+
+   pending = offset - log->syncedOffset;
+   now = monotonicNs ();
+   if ((log->syncBytes == 0 || pending < (size_t) log->syncBytes) &&
+       now - log->lastSync < log->syncInterval * 1000000ULL) {
+      return;
+   }
+
+   if (log->syncMode == SYNC_PERIODIC) {
+      if (fdatasync (log->fd) != 0) perrorf ("fdatasync");
+   } else {
+      if (sync_file_range (log->fd, log->syncedOffset, pending, SYNC_FILE_RANGE_WRITE) != 0) {
+         perrorf ("sync_file_range");
+      }
+      if (log->syncedOffset > log->waitedOffset) {
+         if (sync_file_range (log->fd, log->waitedOffset, log->syncedOffset - log->waitedOffset,
+                              SYNC_FILE_RANGE_WAIT_BEFORE | SYNC_FILE_RANGE_WRITE |
+                              SYNC_FILE_RANGE_WAIT_AFTER) != 0) {
+            perrorf ("sync_file_range (wait)");
+         }
+         log->waitedOffset = log->syncedOffset;
+      }
+   }
+   log->syncedOffset = offset;
+   log->lastSync = monotonicNs ();
+
+   elapsed = log->lastSync - now;
+   STATS_ADD (syncs, 1);
+   STATS_ADD (syncNs, elapsed);
+   STATS_MAX (syncMaxNs, elapsed);
+}
+
+/*------------------------------------------------------------------------------
+ * Complete any gzip stream and close. On rotation, ensure the file ends with a
+ * newline, so that a line split across files is still a line in each; the last
+ * file is left as the input ended.
+ */
+static void fileClose (LogState* log, const bool rotating)
+{
+   static const char newline [2] = "\n";
+
+   if (log->fd < 0) return;
+
+   /* If the data never passed through our hands, recover the last
+    * character from the file itself.
+    */
+   if (rotating && log->lastCharUnknown) {
+      if (log->total == 0 ||
+          pread (log->fd, &log->last_char, 1, log->total - 1) != 1) {
+         log->last_char = '\n';
+      }
+      log->lastCharUnknown = false;
+   }
+
+   if (log->gzip) {
+      if (rotating && log->last_char != '\n' && !log->framed) {
+         log->zs.next_in = (Bytef*) newline;
+         log->zs.avail_in = 1;
+         gzipDeflate (log, Z_NO_FLUSH);
+         log->total++;
+      }
+      log->zs.next_in = NULL;
+      log->zs.avail_in = 0;
+      gzipDeflate (log, Z_FINISH);
+      deflateReset (&log->zs);
+      log->unflushed = false;
+
+   } else if (rotating && log->last_char != '\n' && !log->framed) {
+      STATS_ADD (writes, 1);
+      if (write (log->fd, newline, 1) == 1) log->total++;
+   }
+
+   /* Release any preallocated space beyond the end of the file.
+    */
+   if (log->preallocate) {
+      struct stat st;
+      if (fstat (log->fd, &st) != 0) {
+         perrorf ("fstat");
+      } else if (ftruncate (log->fd, st.st_size) != 0) {
+         perrorf ("ftruncate (%lld)", (long long) st.st_size);
+      }
+   }
+
+   if (log->syncMode != SYNC_NONE) {
+      requestSyncClose (log, log->fd);
+   } else {
+      close (log->fd);
+   }
+   timeIndexClose (log);
+}
+
+/*------------------------------------------------------------------------------
+ * With one second file names, the minimum allowed age is 1 second to avoid
+ * a name clash. The other name formats never clash.
+ */
+static bool sizeRotationAllowed (const LogState* log)
+{
+   return (log->nameFormat != NAME_SECONDS) || (coarseTime () - log->lastTime >= 1);
+}
+
+/*------------------------------------------------------------------------------
+ * The most input, not yet seen, that can go in the current file without it
+ * exceeding the size limit once closed. As in logWrite, this leaves room for
+ * the newline fileClose adds if the input does not end a line.
+ * Returns 0 if the file is full, or maximum if the limit does not apply.
+ */
+size_t unseenRoom (const LogState* log, const size_t maximum)
+{
+   size_t room;
+
+   if (log->gzip && log->sizeCompressed) return maximum;
+   if (log->total + 1 >= log->sizeLimit) {
+      return (log->total > 0 && sizeRotationAllowed (log)) ? 0 : maximum;
+   }
+   room = log->sizeLimit - log->total - 1;
+   return room < maximum ? room : maximum;
+}
+
+/*------------------------------------------------------------------------------
+ * Is a new file required? This is based on size and/or age of file.
+ */
+bool rotationDue (LogState* log)
+{
+   time_t thisTime;
+   time_t age;
+
+   thisTime = coarseTime ();
+   age = thisTime - log->lastTime;
+
+   /* Time to get the next file ready?
+    */
+   if (log->precreateFraction > 0.0 && !log->precreatePending &&
+       ((fileSize (log) >= log->precreateFraction * log->sizeLimit) ||
+        (age >= log->precreateFraction * log->ageLimit))) {
+      requestPrecreate (log);
+   }
+
+   return (age >= log->ageLimit) ||
+          ((closedSize (log) >= log->sizeLimit) && sizeRotationAllowed (log));
+}
+
+/*------------------------------------------------------------------------------
+ * Close the current file and open the next one.
+ * Returns false if the new file could not be created.
+ */
+bool rotateFile (LogState* log)
+{
+   unsigned long long start;
+   unsigned long long elapsed;
+   char* closedName;
+   int closedDir = 0;
+
+   /* Ensure each file has a newline at the end.
+    */
+   fileClose (log, true);
+   closedName = indexUpdateCurrent (log, &closedDir);
+   start = monotonicNs ();
+   log->fd = nextFile (log);   /* also sets lastTime */
+   elapsed = monotonicNs () - start;
+   STATS_ADD (rotations, 1);
+   STATS_ADD (nextFileNs, elapsed);
+   STATS_MAX (nextFileMaxNs, elapsed);
+   log->total = 0;
+   log->compressedTotal = 0;
+   log->last_char = '\n';
+   log->syncedOffset = 0;
+   log->waitedOffset = 0;
+   log->lastSync = monotonicNs ();
+
+   if (log->fd >= 0) {
+      requestPurge (log);
+   }
+
+   /* Only once the next file is open, so as not to delay the data path.
+    */
+   if (closedName) {
+      if (log->compress && !log->gzip) {
+         requestCompress (log, closedDir, closedName);
+      } else {
+         free (closedName);
+      }
+   }
+
+   return log->fd >= 0;
+}
+
+/*------------------------------------------------------------------------------
+ * Timestamped version of logWrite. The added stamps count towards the size
+ * limit, and, as in line aligned mode, a file is rotated before a line that
+ * does not fit rather than part way through it. All the lines in a chunk
+ * share the same stamp, i.e. the time the chunk was written.
+ */
+static int stampedWrite (LogState* log, const char* data, const size_t count)
+{
+   const bool exact = !(log->gzip && log->sizeCompressed);
+   const char* stamp = stampUpdate (&log->stamp);
+   size_t done = 0;
+   int written = 0;
+
+   while (done < count) {
+      StampedList list;
+      size_t room = SIZE_MAX;
+      size_t n;
+
+      if (exact && !log->wholeWrites) {
+         room = log->total < log->sizeLimit ? log->sizeLimit - log->total : 0;
+      }
+      stampLines (&list, stamp, data + done, count - done, log->last_char == '\n',
+                  room, log->total == 0);
+
+      if (log->wholeWrites && exact && log->total > 0 &&
+          log->total + list.length > log->sizeLimit && sizeRotationAllowed (log)) {
+         if (!rotateFile (log)) break;
+         continue;
+      }
+
+      if (list.consumed == 0) {
+         /* No room for any of this data in the current file.
+          */
+         if (sizeRotationAllowed (log)) {
+            if (!rotateFile (log)) break;
+            continue;
+         }
+         stampLines (&list, stamp, data + done, count - done, log->last_char == '\n',
+                     SIZE_MAX, false);
+      }
+
+      n = fileWritev (log, list.iov, list.count);
+      log->total += n;
+      if (n != list.length) break;
+      written += list.consumed;
+      log->last_char = data [done + list.consumed - 1];
+      done += list.consumed;
+
+      if (rotationDue (log)) {
+         if (!rotateFile (log)) break;
+      }
+   }
+
+   return written;
+}
+
+/*------------------------------------------------------------------------------
+ * Unless the size limit applies to the compressed size, the chunk is split so
+ * that no file exceeds the size limit, allowing for the newline added on close.
+ * In line aligned mode, the split is made after the last newline that fits,
+ * found using memrchr, so that lines are not split across files. With
+ * wholeWrites, i.e. when each write is one or more whole records, the chunk is
+ * not split: the file is rotated before a write that would not fit, and a
+ * write larger than the limit goes in a file of its own.
+ */
+static int plainWrite (LogState* log, const char* data, const size_t count)
+{
+   const bool exact = !(log->gzip && log->sizeCompressed);
+   size_t done = 0;
+   int written = 0;
+
+   while (done < count) {
+      size_t part = count - done;
+      size_t needed;          /* allowing for newline added on close */
+      bool full = false;      /* file full once part written */
+      int n;
+
+      /* Would the file reach the limit once closed?
+       */
+      needed = part + (data [count - 1] != '\n' ? 1 : 0);
+
+      if (log->wholeWrites) {
+         if (exact && log->total > 0 && log->total + needed > log->sizeLimit &&
+             sizeRotationAllowed (log)) {
+            if (!rotateFile (log)) break;
+            continue;
+         }
+      } else if (exact && log->total < log->sizeLimit && log->sizeLimit - log->total <= needed) {
+         const char* newline = NULL;
+
+         if (log->sizeLimit - log->total < part) {
+            part = log->sizeLimit - log->total;
+         }
+
+         if (log->lineAlign) {
+            newline = memrchr (data + done, '\n', part);
+            if (newline) {
+               part = newline - (data + done) + 1;
+               full = true;
+            } else if (log->total > 0 && log->last_char == '\n' && sizeRotationAllowed (log)) {
+               /* The line will not fit, so start it in the next file.
+                */
+               if (!rotateFile (log)) break;
+               continue;
+            }
+         }
+
+         if (!newline) {
+            /* Leave room for the newline if the part does not end with one.
+             */
+            if (data [done + part - 1] != '\n') part--;
+            if (part == 0) {
+               /* No room for any of this data in the current file.
+                */
+               if (sizeRotationAllowed (log)) {
+                  if (!rotateFile (log)) break;
+                  continue;
+               }
+               part = count - done;
+            }
+         }
+      }
+
+      n = fileWrite (log, data + done, part);
+      if (n > 0) {
+         log->total += n;
+         written += n;
+      }
+      log->last_char = data [done + part - 1];
+      done += part;
+
+      if ((full && sizeRotationAllowed (log)) || rotationDue (log)) {
+         if (!rotateFile (log)) break;
+      }
+   }
+
+   return written;
+}
+
+/*------------------------------------------------------------------------------
+ */
+static int lineWrite (LogState* log, const char* data, const size_t count)
+{
+   int written;
+
+   if (log->timestamp) {
+      written = stampedWrite (log, data, count);
+   } else {
+      written = plainWrite (log, data, count);
+   }
+   STATS_ADD (bytesOut, written);
+   return written;
+}
+
+/*------------------------------------------------------------------------------
+ * Add the tokens accrued since the last refill, up to the bucket size.
+ */
+static void rateRefill (Rate* rate)
+{
+   const unsigned long long now = monotonicNs ();
+
+   rate->tokens += (now - rate->lastRefill) * 1.0e-9 * rate->limit;
+   if (rate->tokens > rate->burst) {
+      rate->tokens = rate->burst;
+   }
+   rate->lastRefill = now;
+}
+
+/*------------------------------------------------------------------------------
+ * Decide whether the line now starting is to be written. When blocking, waits
+ * until the bucket is no longer empty.
+ */
+static bool rateAdmit (Rate* rate)
+{
+   if (rate->tokens > 0) return true;
+
+   switch (rate->policy) {
+      case RATE_BLOCK: {
+         const unsigned long long start = monotonicNs ();
+
+         while (rate->tokens <= 0) {
+            const double wait = (1.0 - rate->tokens) / rate->limit;
+            struct timespec delay;
+
+            delay.tv_sec = (time_t) wait;
+            delay.tv_nsec = (long) ((wait - delay.tv_sec) * 1.0e9);
+            nanosleep (&delay, NULL);
+            rateRefill (rate);
+         }
+         STATS_ADD (rateBlockedNs, monotonicNs () - start);
+         return true;
+      }
+
+      case RATE_SAMPLE:
+         return ++rate->excess % rate->sample == 0;
+
+      default:
+         return false;
+   }
+}
+
+/*------------------------------------------------------------------------------
+ * Write the marker line for any lines dropped by the rate limit, so that the gap
+ * is visible. The marker itself is not subject to the limit, and is deferred
+ * while a line is part written.
+ */
+static void rateFlush (LogState* log)
+{
+   Rate* rate = &log->rate;
+   char marker [96];
+   int n;
+
+   if (rate->droppedLines == 0 || log->fd < 0) return;
+   if (rate->midLine && !rate->dropping) return;
+
+   n = snprintf (marker, sizeof (marker), "%lu lines (%llu bytes) dropped, rate limit exceeded\n",
+                 rate->droppedLines, rate->droppedBytes);
+   lineWrite (log, marker, n);
+   rate->droppedLines = 0;
+   rate->droppedBytes = 0;
+}
+
+/*------------------------------------------------------------------------------
+ * Write the admitted data from *first up to end.
+ * Returns false on a short write, with *first advanced by the amount written.
+ */
+static bool rateEmit (LogState* log, const char* data, size_t* first, const size_t end)
+{
+   const size_t n = end - *first;
+   int written;
+
+   if (n == 0) return true;
+
+   written = lineWrite (log, data + *first, n);
+   if (written != (int) n) {
+      *first += written > 0 ? written : 0;
+      return false;
+   }
+   *first = end;
+   return true;
+}
+
+/*------------------------------------------------------------------------------
+ * Token bucket limit on the rate of writing to the log file. The bucket fills at
+ * limit bytes per second, up to burst bytes, and each line written takes its
+ * length, plus that of the timestamp if any. A line may be started while the
+ * bucket is not empty, and so may leave it in debt. The decision is made per
+ * line, a line split across writes following the decision made at its start.
+ * Excess lines are dropped, and counted by a marker line written before the
+ * next line once a second has passed and on each tick; or 1 in N is written
+ * regardless (sample); or the write waits for the bucket to refill (block),
+ * which in turn holds up the input.
+ * Returns count, i.e. dropped data counts as written, or less on a write error.
+ */
+static int rateWrite (LogState* log, const char* data, const size_t count)
+{
+   Rate* rate = &log->rate;
+   size_t first = 0;       /* admitted data not yet written */
+   size_t done = 0;
+
+   if (rate->limit <= 0) {
+      return lineWrite (log, data, count);
+   }
+
+   rateRefill (rate);
+
+   while (done < count) {
+      const char* eol = memchr (data + done, '\n', count - done);
+      const size_t length = eol ? (size_t) (eol - data - done) + 1 : count - done;
+      const bool start = !rate->midLine;
+
+      if (start) {
+         if (rate->tokens <= 0 && rate->policy == RATE_BLOCK) {
+            if (!rateEmit (log, data, &first, done)) return first;
+         }
+         rate->sampled = rate->tokens <= 0 && rate->policy == RATE_SAMPLE;
+         rate->dropping = !rateAdmit (rate);
+         if (!rate->dropping && !rate->sampled) {
+            rate->tokens -= log->timestamp ? STAMP_LENGTH : 0;
+         }
+      }
+
+      if (rate->dropping) {
+         if (!rateEmit (log, data, &first, done)) return first;
+         if (start && rate->droppedLines++ == 0) {
+            rate->firstDrop = coarseTime ();
+         }
+         rate->droppedBytes += length;
+         if (start) STATS_ADD (rateLines, 1);
+         STATS_ADD (rateBytes, length);
+         first = done + length;
+
+      } else {
+         if (start && rate->droppedLines > 0 && coarseTime () != rate->firstDrop) {
+            if (!rateEmit (log, data, &first, done)) return first;
+            rateFlush (log);
+         }
+         if (!rate->sampled) {
+            rate->tokens -= length;
+         }
+      }
+
+      rate->midLine = !eol;
+      done += length;
+   }
+
+   if (!rateEmit (log, data, &first, count)) return first;
+   return count;
+}
+
+/*------------------------------------------------------------------------------
+ * Write any summary of suppressed lines to the log file. When idle, also write
+ * any incomplete line held back since before the previous tick (or at all when
+ * finishing), so that a prompt, say, is not held indefinitely.
+ */
+static void dedupFlush (LogState* log, const bool idle)
+{
+   char summary [64];
+   const size_t n = dedupSummary (&log->dedup, summary, sizeof (summary));
+
+   if (log->fd < 0) return;
+   if (n > 0) {
+      lineWrite (log, summary, n);
+   }
+   if (idle && log->dedup.pendingTicked && dedupRelease (&log->dedup) > 0) {
+      rateWrite (log, log->dedup.pending, log->dedup.pendingLength);
+      log->dedup.pendingLength = 0;
+   }
+}
+
+/*------------------------------------------------------------------------------
+ * Write the data without the repeated lines. The suppressed and held back data
+ * count as written in the returned length.
+ */
+static int dedupWrite (LogState* log, const char* data, const size_t count)
+{
+   size_t done = 0;
+
+   while (done < count && log->fd >= 0) {
+      const unsigned long before = log->dedup.repeats;
+      enum DedupAction action;
+      const size_t n = dedupSpan (&log->dedup, data + done, count - done, &action);
+      int written;
+
+      switch (action) {
+         case DEDUP_WRITE:
+            dedupFlush (log, false);
+            written = rateWrite (log, data + done, n);
+            if (written != (int) n) return done + (written > 0 ? written : 0);
+            break;
+
+         case DEDUP_PENDING:
+            dedupFlush (log, false);
+            rateWrite (log, log->dedup.pending, log->dedup.pendingLength);
+            log->dedup.pendingLength = 0;
+            break;
+
+         case DEDUP_SUPPRESS:
+            STATS_ADD (dedupLines, log->dedup.repeats - before);
+            STATS_ADD (dedupBytes, n);
+            if (dedupSummaryDue (&log->dedup)) dedupFlush (log, false);
+            break;
+
+         case DEDUP_HOLD:
+            break;
+      }
+      done += n;
+   }
+   return done;
+}
+
+/*------------------------------------------------------------------------------
+ * The length of the record, including the header, at data.
+ */
+static size_t frameLength (const char* data)
+{
+   const unsigned char* p = (const unsigned char*) data;
+
+   return FRAME_HEADER + (((size_t) p [0] << 24) | ((size_t) p [1] << 16) |
+                          ((size_t) p [2] << 8) | (size_t) p [3]);
+}
+
+/*------------------------------------------------------------------------------
+ * Report a record too long to be genuine: the framing has been lost, and with
+ * no delimiter to resynchronise on, the rest of the input is discarded.
+ */
+static void frameLost (LogState* log, const size_t length)
+{
+   fprintf (stderr, "*** framing error, record length %lu exceeds %d, input discarded\n",
+            (unsigned long) length - FRAME_HEADER, FRAME_RECORD_MAX);
+   log->frameError = true;
+   log->frameUsed = 0;
+}
+
+/*------------------------------------------------------------------------------
+ * Add to the carried over record as much data as it needs, which is none once
+ * it is complete. Returns the number of bytes taken.
+ */
+static size_t frameCarry (LogState* log, const char* data, const size_t count)
+{
+   size_t done = 0;
+
+   while (done < count && !log->frameError) {
+      size_t need;
+      size_t n;
+
+      if (log->frameUsed < FRAME_HEADER) {
+         need = FRAME_HEADER;
+      } else {
+         need = frameLength (log->frame);
+         if (need > FRAME_RECORD_MAX) {
+            frameLost (log, need);
+            break;
+         }
+      }
+      if (log->frameUsed == need) break;   /* complete */
+
+      if (need > log->frameSize) {
+         const size_t size = need > 65536 ? need : 65536;
+         char* more = realloc (log->frame, size);
+         if (!more) {
+            perrorf ("record buffer allocation (%lu)", (unsigned long) size);
+            break;
+         }
+         log->frame = more;
+         log->frameSize = size;
+      }
+
+      n = need - log->frameUsed < count - done ? need - log->frameUsed : count - done;
+      memcpy (log->frame + log->frameUsed, data + done, n);
+      log->frameUsed += n;
+      done += n;
+   }
+   return done;
+}
+
+/*------------------------------------------------------------------------------
+ */
+static bool frameComplete (const LogState* log)
+{
+   return log->frameUsed >= FRAME_HEADER && log->frameUsed == frameLength (log->frame);
+}
+
+/*------------------------------------------------------------------------------
+ * Framed input: each record is a 4 byte big endian length followed by that many
+ * bytes of data, which may contain anything, newlines included. Only whole
+ * records are written, with their headers, so the files can be walked record by
+ * record, rotation is only ever at a record boundary, and every time index
+ * offset is that of a record. A record is only split from the next file when it
+ * is larger than the size limit, in which case it goes in a file of its own.
+ * The complete records in a chunk are written from the chunk itself, together
+ * with the completed carried over record if any, using writev; only a record
+ * incomplete at the end of the chunk is copied, to be carried over.
+ * Returns count, unless the file could not be written.
+ */
+static int framedWrite (LogState* log, const char* data, const size_t count)
+{
+   const bool exact = !(log->gzip && log->sizeCompressed);
+   bool force = false;     /* size rotation not yet allowed, so write anyway */
+   size_t done = 0;
+
+   while (log->fd >= 0 && !log->frameError) {
+      struct iovec iov [2];
+      const bool carried = log->frameUsed > 0;
+      size_t room = SIZE_MAX;
+      size_t length = 0;
+      size_t run = 0;
+      bool full = false;
+      int n = 0;
+
+      if (carried) {
+         done += frameCarry (log, data + done, count - done);
+         if (!frameComplete (log)) break;
+      }
+
+      if (exact && !force) {
+         room = log->total < log->sizeLimit ? log->sizeLimit - log->total : 0;
+      }
+
+      if (carried) {
+         if (log->frameUsed > room && log->total > 0) {
+            full = true;
+         } else {
+            iov [n].iov_base = log->frame;
+            iov [n].iov_len = log->frameUsed;
+            n++;
+            length = log->frameUsed;
+         }
+      }
+
+      /* The run of complete records that fit.
+       */
+      while (!full && done + run + FRAME_HEADER <= count) {
+         const size_t record = frameLength (data + done + run);
+
+         if (record > FRAME_RECORD_MAX) {
+            frameLost (log, record);
+            break;
+         }
+         if (done + run + record > count) break;   /* incomplete */
+         if (length + record > room && (length > 0 || log->total > 0)) {
+            full = true;
+            break;
+         }
+         run += record;
+         length += record;
+      }
+      if (run > 0) {
+         iov [n].iov_base = (char*) data + done;
+         iov [n].iov_len = run;
+         n++;
+      }
+
+      if (n > 0) {
+         const size_t written = fileWritev (log, iov, n);
+
+         log->total += written;
+         STATS_ADD (bytesOut, written);
+         if (written != length) return done;
+         if (carried) log->frameUsed = 0;
+         done += run;
+         force = false;
+      }
+
+      if (full && !sizeRotationAllowed (log)) {
+         force = true;
+         continue;
+      }
+      if (full || rotationDue (log)) {
+         if (!rotateFile (log)) break;
+         continue;
+      }
+      if (n == 0) break;
+   }
+
+   if (log->frameError) {
+      STATS_ADD (dropped, count - done);
+      return count;
+   }
+
+   /* Carry over the incomplete record at the end.
+    */
+   if (done < count && log->fd >= 0) {
+      done += frameCarry (log, data + done, count - done);
+   }
+   return log->fd >= 0 ? count : done;
+}
+
+/*------------------------------------------------------------------------------
+ * Write a chunk of data to the current log file, and rotate if required.
+ * Returns the number of bytes written. On return log->fd is negative if a new
+ * file was required but could not be created.
+ */
+int logWrite (LogState* log, const char* data, const size_t count)
+{
+   const unsigned long long start = monotonicNs ();
+   int written;
+   int j;
+
+   /* The mirrors' writer threads write their copies concurrently with this.
+    */
+   for (j = 0; j < log->numberMirrors; j++) {
+      rl_write (log->mirrors [j], data, count);
+   }
+
+   if (log->framed) {
+      written = framedWrite (log, data, count);
+   } else if (log->dedup.window > 0) {
+      written = dedupWrite (log, data, count);
+   } else {
+      written = rateWrite (log, data, count);
+   }
+
+   logSync (log);
+
+   STATS_MAX (maxStallNs, monotonicNs () - start);
+   return written;
+}
+
+/*------------------------------------------------------------------------------
+ * Periodic processing, called on each tick (about once a second) whether or
+ * not there is any input: the gzip stream is flushed and age rotation applied,
+ * so that an idle file does not remain open past the age limit.
+ */
+void logTick (LogState* log)
+{
+   if (log->fd < 0) return;
+
+   dedupFlush (log, true);
+   log->dedup.pendingTicked = log->dedup.pendingLength > 0;
+   rateFlush (log);
+
+   if (log->gzip && log->unflushed) {
+      gzipDeflate (log, Z_SYNC_FLUSH);
+      log->lastFlush = coarseTime ();
+      log->unflushed = false;
+   }
+
+   if (rotationDue (log)) {
+      rotateFile (log);
+   } else {
+      logSync (log);
+   }
+}
+
+/*------------------------------------------------------------------------------
+ * Set up a log, from the limits and settings already in log, and open its first
+ * file. The compressor, if required, must already be started.
+ * Returns false if the directory or the first file could not be created.
+ */
+bool logStart (LogState* log)
+{
+   int j;
+
+   if (!log->stripe) {
+      log->numberDirectories = 1;
+   }
+   for (j = 0; j < log->numberDirectories; j++) {
+      const char* directory = LOG_DIRECTORY (log, j);
+      if (!mkdir_parents (directory, 0755)) {
+         perrorf ("mkdir (%s,0755)", directory);
+         return false;
+      }
+   }
+
+   log->reaperNext = NULL;
+   log->reaperQueued = false;
+   log->purgeRequested = false;
+   log->precreateRequested = false;
+   log->precreatePending = false;
+   log->spareFd = -1;
+   log->lastNameUnits = 0;
+   log->sequence = 0;
+   log->compressedTotal = 0;
+   log->lastFlush = 0;
+   log->unflushed = false;
+   log->lastCharUnknown = false;
+   log->zbuffer = NULL;
+   memset (&log->stamp, 0, sizeof (log->stamp));
+   log->dedup.used = 0;
+   log->dedup.next = 0;
+   log->dedup.midLine = false;
+   log->dedup.pendingLength = 0;
+   log->dedup.repeats = 0;
+   log->rate.tokens = log->rate.burst;
+   log->rate.lastRefill = monotonicNs ();
+   log->rate.midLine = false;
+   log->rate.dropping = false;
+   log->rate.sampled = false;
+   log->rate.excess = 0;
+   log->rate.droppedLines = 0;
+   log->rate.droppedBytes = 0;
+   log->frameError = false;
+   log->frame = NULL;
+   log->frameUsed = 0;
+   log->frameSize = 0;
+   log->syncedOffset = 0;
+   log->waitedOffset = 0;
+   log->lastSync = monotonicNs ();
+   log->closingHead = NULL;
+   log->closingTail = NULL;
+   log->timeIndexFd = -1;
+   log->compressPending = 0;
+
+   if (log->gzip) {
+      memset (&log->zs, 0, sizeof (log->zs));
+      log->zbuffer = malloc (GZIP_BUFFER_SIZE);
+      /* 15 + 16 => gzip rather than zlib wrapper
+       */
+      if (!log->zbuffer ||
+          deflateInit2 (&log->zs, 6, Z_DEFLATED, 15 + 16, 8, Z_DEFAULT_STRATEGY) != Z_OK) {
+         fprintf (stderr, "gzip stream initialisation failed\n");
+         free (log->zbuffer);
+         log->zbuffer = NULL;
+         return false;
+      }
+   }
+   memset (&log->index, 0, sizeof (log->index));
+   pthread_mutex_init (&log->index.mutex, NULL);
+
+   /* This is the only full scan of the directory, unless re-syncing.
+    */
+   indexScan (&log->index, log->stripe ? log->stripe : &log->directory,
+              log->numberDirectories, log->prefix);
+
+   /* Carry on striping from the newest file.
+    */
+   log->directoryNumber = log->numberDirectories - 1;
+   if (log->index.count > 0) {
+      const FileEntry* newest = &INDEX_ENTRY (&log->index, log->index.count - 1);
+      time_t nameTime;
+      long fraction;
+
+      log->directoryNumber = newest->dir;
+      if (parseNameTime (log, newest->name, &nameTime, &fraction)) {
+         seedNameUnits (log, nameTime, fraction);
+      }
+   }
+
+   log->fd = -1;
+   if (log->resume) {
+      log->fd = resumeFile (log);
+   }
+
+   if (log->compress) {
+      compressExisting (log);
+   }
+
+   if (log->fd >= 0) {
+      return true;
+   }
+
+   log->fd = nextFile (log);
+   if (log->fd < 0) {
+      return false;
+   }
+   log->total = 0;
+   log->last_char = '\n';
+   return true;
+}
+
+/*------------------------------------------------------------------------------
+ * Close the current file and release the log's resources.
+ */
+void logFinish (LogState* log)
+{
+   log->dedup.pendingTicked = true;
+   dedupFlush (log, true);
+   log->rate.midLine = false;
+   rateFlush (log);
+   if (log->frameUsed > 0) {
+      fprintf (stderr, "*** incomplete final record (%lu bytes) discarded\n",
+               (unsigned long) log->frameUsed);
+      STATS_ADD (dropped, log->frameUsed);
+      log->frameUsed = 0;
+   }
+   free (log->frame);
+   log->frame = NULL;
+   fileClose (log, false);
+   log->fd = -1;
+   discardSpare (log);
+   if (log->zbuffer) {
+      deflateEnd (&log->zs);
+      free (log->zbuffer);
+      log->zbuffer = NULL;
+   }
+}
+
+/*------------------------------------------------------------------------------
+ * Apply the minimum limits: 10 seconds, 20 bytes (more when timestamping, so
+ * that a stamped line always fits), and 1 file kept in addition to the current.
+ */
+void sanitiseLimits (long* ageLimit, long* sizeLimit, int* numberToKeep,
+                     const bool timestamp)
+{
+   if (*ageLimit < 10) {
+      *ageLimit = 10;
+   }
+   if (*sizeLimit < 20) {
+      *sizeLimit = 20;
+   }
+   if (timestamp && *sizeLimit < STAMP_LENGTH + 20) {
+      *sizeLimit = STAMP_LENGTH + 20;
+   }
+   if (*numberToKeep < 1) {
+      *numberToKeep = 1;
+   }
+}
+
+/*------------------------------------------------------------------------------
+ * Library API, see rotation_logger.h.
+ * Application threads push records onto a lock-free multi-producer, single
+ * consumer queue (an intrusive list, Vyukov style, where a push is one atomic
+ * exchange). A writer thread per logger pops the records, coalesces them into a
+ * buffer and writes them to the files as per the threaded mode writer. Producers
+ * only make a system call, to signal the eventfd, when the writer has gone to
+ * sleep on an empty queue. The reaper and compressor threads are shared by all
+ * the open loggers.
+ */
+typedef struct QueueNode {
+   struct QueueNode* next;
+   size_t length;
+   char data [];
+} QueueNode;
+
+struct rl_logger {
+   LogState log;
+   char* directory;
+   char* prefix;
+   QueueNode* head;              /* consumed node (stub), writer only */
+   QueueNode* tail;              /* last pushed node, producers */
+   long queued;                  /* bytes */
+   long queueLimit;
+   int wakeFd;
+   int sleeping;                 /* writer waiting on wakeFd */
+   bool closing;
+   bool failed;                  /* next file could not be created */
+   bool mirror;                  /* writes wait for room, not counted as input */
+   int waiting;                  /* mirror waiting for room, see rlWaitForRoom */
+   pthread_mutex_t roomMutex;
+   pthread_cond_t room;
+   pthread_t writer;
+};
+
+static struct {
+   pthread_mutex_t mutex;
+   int users;
+} library = { .mutex = PTHREAD_MUTEX_INITIALIZER };
+
+/*------------------------------------------------------------------------------
+ */
+void rl_options_init (rl_options* options)
+{
+   memset (options, 0, sizeof (rl_options));
+   options->sizeLimit = 50 * 1000 * 1000;
+   options->ageLimit = 24 * 3600;
+   options->numberToKeep = 40;
+   options->nameFormat = RL_NAME_SECONDS;
+   options->sync = RL_SYNC_NONE;
+   options->syncInterval = 1000;
+   options->rateSample = 10;
+   options->queueLimit = 16 * 1000 * 1000;
+}
+
+/*------------------------------------------------------------------------------
+ * Producers: the node is linked after the previous tail once it has become the
+ * tail, so the writer may briefly see a tail with no link to it yet. The wake
+ * up check follows the link, so that the writer either sees the node or is woken.
+ */
+static void queuePush (rl_logger* logger, QueueNode* node)
+{
+   QueueNode* previous;
+
+   node->next = NULL;
+   previous = __atomic_exchange_n (&logger->tail, node, __ATOMIC_ACQ_REL);
+   __atomic_store_n (&previous->next, node, __ATOMIC_SEQ_CST);
+
+   if (__atomic_exchange_n (&logger->sleeping, 0, __ATOMIC_SEQ_CST)) {
+      const uint64_t one = 1;
+      if (write (logger->wakeFd, &one, sizeof (one))) { /* ignored */ }
+   }
+}
+
+/*------------------------------------------------------------------------------
+ * Writer: the next node to consume, or NULL.
+ */
+static QueueNode* queuePeek (rl_logger* logger)
+{
+   return __atomic_load_n (&logger->head->next, __ATOMIC_ACQUIRE);
+}
+
+/*------------------------------------------------------------------------------
+ * Writer: wake a mirror waiting in rlWaitForRoom. The waiting flag is set before
+ * the mirror last checks the queue, so either it sees the room made or it is
+ * signalled here.
+ */
+static void rlRoomMade (rl_logger* logger)
+{
+   if (__atomic_load_n (&logger->waiting, __ATOMIC_SEQ_CST)) {
+      pthread_mutex_lock (&logger->roomMutex);
+      pthread_cond_signal (&logger->room);
+      pthread_mutex_unlock (&logger->roomMutex);
+   }
+}
+
+/*------------------------------------------------------------------------------
+ * Writer: the peeked node becomes the stub, and the previous stub is freed.
+ */
+static void queuePop (rl_logger* logger, QueueNode* node)
+{
+   free (logger->head);
+   logger->head = node;
+   __atomic_fetch_sub (&logger->queued, node->length, __ATOMIC_SEQ_CST);
+   rlRoomMade (logger);
+}
+
+/*------------------------------------------------------------------------------
+ * Write a chunk, or drop it if the log has failed.
+ */
+static void rlWriteChunk (rl_logger* logger, const char* data, const size_t count)
+{
+   if (logger->log.fd < 0) {
+      STATS_ADD (dropped, count);
+      return;
+   }
+   logWrite (&logger->log, data, count);
+   if (logger->log.fd < 0) {
+      __atomic_store_n (&logger->failed, true, __ATOMIC_SEQ_CST);
+      rlRoomMade (logger);
+   }
+}
+
+/*------------------------------------------------------------------------------
+ */
+static void* rlWriter (void* arg)
+{
+   rl_logger* logger = (rl_logger*) arg;
+   char* buffer = malloc (RING_BUFFER_SIZE);
+   time_t lastTick = coarseTime ();
+
+   statsExcluded = logger->mirror;
+
+   while (true) {
+      QueueNode* node;
+      size_t used = 0;
+
+      while ((node = queuePeek (logger)) != NULL) {
+         if (buffer && node->length <= RING_BUFFER_SIZE) {
+            /* Each write is of whole records, and a batch that would not fit
+             * in the current file would all go in the next one.
+             */
+            if (used + node->length > RING_BUFFER_SIZE ||
+                (used > 0 && logger->log.total + used + node->length >= logger->log.sizeLimit)) {
+               rlWriteChunk (logger, buffer, used);
+               used = 0;
+            }
+            memcpy (buffer + used, node->data, node->length);
+            used += node->length;
+         } else {
+            if (used > 0) {
+               rlWriteChunk (logger, buffer, used);
+               used = 0;
+            }
+            rlWriteChunk (logger, node->data, node->length);
+         }
+         queuePop (logger, node);
+      }
+      if (used > 0) {
+         rlWriteChunk (logger, buffer, used);
+      }
+
+      if (coarseTime () != lastTick) {
+         lastTick = coarseTime ();
+         logTick (&logger->log);
+      }
+
+      if (__atomic_load_n (&logger->closing, __ATOMIC_ACQUIRE)) {
+         if (!queuePeek (logger)) break;
+         continue;
+      }
+
+      /* Announce we are going to sleep, then check again before doing so.
+       */
+      __atomic_store_n (&logger->sleeping, 1, __ATOMIC_SEQ_CST);
+      if (__atomic_load_n (&logger->head->next, __ATOMIC_SEQ_CST) == NULL) {
+         struct pollfd fds;
+         uint64_t count;
+
+         fds.fd = logger->wakeFd;
+         fds.events = POLLIN;
+         if (poll (&fds, 1, 1000) > 0) {
+            if (read (logger->wakeFd, &count, sizeof (count))) { /* ignored */ }
+         }
+      }
+      __atomic_store_n (&logger->sleeping, 0, __ATOMIC_SEQ_CST);
+   }
+
+   free (buffer);
+   return NULL;
+}
+
+/*------------------------------------------------------------------------------
+ * Start the shared background threads for the first logger, and the
+ * compressor when first required.
+ */
+static void libraryAttach (const bool compress)
+{
+   pthread_mutex_lock (&library.mutex);
+   if (library.users++ == 0) {
+      reaperStart (NULL);
+   }
+   if (compress && compressor.number == 0) {
+      compressorStart (2);
+   }
+   pthread_mutex_unlock (&library.mutex);
+}
+
+/*------------------------------------------------------------------------------
+ * Wait for the shared threads to finish with the log, and stop them once the
+ * last logger is closed.
+ */
+static void libraryDetach (LogState* log)
+{
+   reaperRelease (log);
+   compressorRelease (log);
+
+   pthread_mutex_lock (&library.mutex);
+   if (--library.users == 0) {
+      compressorStop ();
+      reaperStop ();
+   }
+   pthread_mutex_unlock (&library.mutex);
+}
+
+/*------------------------------------------------------------------------------
+ */
+static void rlFree (rl_logger* logger)
+{
+   pthread_mutex_lock (&logger->log.index.mutex);
+   indexClear (&logger->log.index);
+   pthread_mutex_unlock (&logger->log.index.mutex);
+   free (logger->log.index.entries);
+   if (logger->wakeFd >= 0) close (logger->wakeFd);
+   pthread_cond_destroy (&logger->room);
+   pthread_mutex_destroy (&logger->roomMutex);
+   free (logger->head);
+   free (logger->directory);
+   free (logger->prefix);
+   free (logger);
+}
+
+/*------------------------------------------------------------------------------
+ * Is there room for count bytes: the data fits within the queue limit, or the
+ * queue is empty, or the log has failed (so the data will be dropped).
+ */
+static bool rlRoom (rl_logger* logger, const size_t count)
+{
+   const long queued = __atomic_load_n (&logger->queued, __ATOMIC_SEQ_CST);
+
+   return queued == 0 || queued + (long) count <= logger->queueLimit ||
+          __atomic_load_n (&logger->failed, __ATOMIC_SEQ_CST);
+}
+
+/*------------------------------------------------------------------------------
+ * A mirror (the only producer) waits for the writer to catch up, woken by
+ * rlRoomMade as the writer consumes the queue.
+ */
+static void rlWaitForRoom (rl_logger* logger, const size_t count)
+{
+   if (rlRoom (logger, count)) return;
+
+   pthread_mutex_lock (&logger->roomMutex);
+   __atomic_store_n (&logger->waiting, 1, __ATOMIC_SEQ_CST);
+   while (!rlRoom (logger, count)) {
+      pthread_cond_wait (&logger->room, &logger->roomMutex);
+   }
+   __atomic_store_n (&logger->waiting, 0, __ATOMIC_SEQ_CST);
+   pthread_mutex_unlock (&logger->roomMutex);
+}
+
+/*------------------------------------------------------------------------------
+ * Open a logger with a copy of the settings, and start its writer thread.
+ * A mirror's writes wait for room in the queue rather than fail.
+ */
+static rl_logger* rlStart (const char* directory, const char* prefix, const LogState* settings,
+                           const long queueLimit, const bool mirror)
+{
+   rl_logger* logger;
+   LogState* log;
+   int status;
+
+   logger = calloc (1, sizeof (rl_logger));
+   if (!logger) return NULL;
+   pthread_mutex_init (&logger->roomMutex, NULL);
+   pthread_cond_init (&logger->room, NULL);
+   logger->directory = strdup (directory);
+   logger->prefix = strdup (prefix);
+   logger->head = calloc (1, sizeof (QueueNode));
+   logger->tail = logger->head;
+   logger->queueLimit = queueLimit;
+   logger->mirror = mirror;
+   logger->wakeFd = eventfd (0, EFD_CLOEXEC | EFD_NONBLOCK);
+   if (!logger->directory || !logger->prefix || !logger->head || logger->wakeFd < 0) {
+      perrorf ("rl_open");
+      rlFree (logger);
+      return NULL;
+   }
+
+   log = &logger->log;
+   *log = *settings;
+   log->fd = -1;
+   log->spareFd = -1;
+   log->directory = logger->directory;
+   log->prefix = logger->prefix;
+   log->stripe = NULL;
+   log->numberMirrors = 0;
+   log->wholeWrites = !mirror;   /* a mirror follows the program's settings */
+
+   libraryAttach (log->compress);
+   if (!logStart (log)) {
+      logFinish (log);
+      libraryDetach (log);
+      rlFree (logger);
+      return NULL;
+   }
+   requestPurge (log);
+
+   status = pthread_create (&logger->writer, NULL, rlWriter, logger);
+   if (status != 0) {
+      errno = status;
+      perrorf ("pthread_create (rl_open)");
+      logFinish (log);
+      libraryDetach (log);
+      rlFree (logger);
+      return NULL;
+   }
+   return logger;
+}
+
+/*------------------------------------------------------------------------------
+ */
+rl_logger* rl_open (const char* directory, const char* prefix, const rl_options* options)
+{
+   rl_options defaults;
+   LogState settings;
+   LogState* log = &settings;
+
+   if (!options) {
+      rl_options_init (&defaults);
+      options = &defaults;
+   }
+
+   memset (&settings, 0, sizeof (settings));
+   log->sizeLimit = options->sizeLimit;
+   log->ageLimit = options->ageLimit;
+   log->numberToKeep = options->numberToKeep;
+   log->timestamp = options->timestamp != 0;
+   sanitiseLimits (&log->ageLimit, &log->sizeLimit, &log->numberToKeep, log->timestamp);
+   log->maxTotal = options->maxTotal > 0 ? options->maxTotal : 0;
+   log->maxAge = options->maxAge > 0 ? options->maxAge : 0;
+   log->nameFormat = (enum NameFormat) options->nameFormat;
+   log->compress = options->compress != 0;
+   log->gzip = options->gzip != 0;
+   log->lineAlign = options->lineAlign != 0;
+   log->timeIndex = options->timeIndex != 0;
+   log->resume = options->resume != 0 && options->framed == 0;
+   log->framed = options->framed != 0;
+   log->dedup.window = options->dedup < 0 ? 0 :
+                       options->dedup > DEDUP_WINDOW_MAX ? DEDUP_WINDOW_MAX : options->dedup;
+   log->rate.limit = options->maxRate > 0 ? options->maxRate : 0;
+   log->rate.burst = options->rateBurst > 0 ? options->rateBurst : log->rate.limit;
+   log->rate.policy = (enum RatePolicy) options->ratePolicy;
+   log->rate.sample = options->rateSample > 1 ? options->rateSample : 1;
+   log->syncMode = (enum SyncMode) options->sync;
+   log->syncInterval = options->syncInterval > 0 ? options->syncInterval : 0;
+   log->syncBytes = options->syncBytes > 0 ? options->syncBytes : 0;
+   if (log->syncBytes == 0 && log->syncMode == SYNC_WRITEBEHIND) {
+      log->syncBytes = 1000000;
+   }
+
+   return rlStart (directory, prefix, &settings,
+                   options->queueLimit > 0 ? options->queueLimit : 16 * 1000 * 1000, false);
+}
+
+/*------------------------------------------------------------------------------
+ */
+ssize_t rl_write (rl_logger* logger, const void* data, size_t count)
+{
+   QueueNode* node;
+
+   if (count == 0) return 0;
+
+   if (__atomic_load_n (&logger->failed, __ATOMIC_ACQUIRE)) {
+      errno = EIO;
+      return -1;
+   }
+
+   if (__atomic_add_fetch (&logger->queued, count, __ATOMIC_RELAXED) > logger->queueLimit) {
+      __atomic_fetch_sub (&logger->queued, count, __ATOMIC_RELAXED);
+      if (!logger->mirror) {
+         STATS_ADD (dropped, count);
+         errno = EAGAIN;
+         return -1;
+      }
+      rlWaitForRoom (logger, count);
+      __atomic_add_fetch (&logger->queued, count, __ATOMIC_RELAXED);
+   }
+
+   node = malloc (sizeof (QueueNode) + count);
+   if (!node) {
+      __atomic_fetch_sub (&logger->queued, count, __ATOMIC_RELAXED);
+      errno = ENOMEM;
+      return -1;
+   }
+   node->length = count;
+   memcpy (node->data, data, count);
+   if (!logger->mirror) STATS_ADD (bytesIn, count);
+
+   queuePush (logger, node);
+   return count;
+}
+
+/*------------------------------------------------------------------------------
+ */
+void rl_close (rl_logger* logger)
+{
+   const uint64_t one = 1;
+
+   if (!logger) return;
+
+   __atomic_store_n (&logger->closing, true, __ATOMIC_RELEASE);
+   if (write (logger->wakeFd, &one, sizeof (one))) { /* ignored */ }
+   pthread_join (logger->writer, NULL);
+
+   logFinish (&logger->log);
+   libraryDetach (&logger->log);
+   rlFree (logger);
+}
+
+/*------------------------------------------------------------------------------
+ * Mirrors: a copy of the log is written to each further directory, with the
+ * same settings, by a logger of its own, fed by logWrite. The program holds the
+ * shared reaper and compressor threads, already running, so that they are not
+ * stopped when the mirrors are closed.
+ */
+#define MIRROR_QUEUE_LIMIT  (16 * 1000 * 1000)
+
+bool mirrorStart (LogState* log, const LogState* settings,
+                  const char* const* directories, const int number)
+{
+   int j;
+
+   pthread_mutex_lock (&library.mutex);
+   library.users++;
+   pthread_mutex_unlock (&library.mutex);
+
+   for (j = 0; j < number; j++) {
+      rl_logger* mirror = rlStart (directories [j], log->prefix, settings,
+                                   MIRROR_QUEUE_LIMIT, true);
+      if (!mirror) return false;
+      log->mirrors [log->numberMirrors++] = mirror;
+   }
+   return true;
+}
+
+/*------------------------------------------------------------------------------
+ * Write out and close the mirrors, after the main log is finished.
+ */
+void mirrorStop (LogState* log)
+{
+   while (log->numberMirrors > 0) {
+      rl_close (log->mirrors [--log->numberMirrors]);
+   }
+
+   pthread_mutex_lock (&library.mutex);
+   library.users--;
+   pthread_mutex_unlock (&library.mutex);
+}
+
+/* end */
@@ -0,0 +1,361 @@
+/* rotation_engine.h
+ * 
+ * Copyright (C) 2019-2023  Andrew C. Starritt
+ * All rights reserved.
+ *
+ * The rotation logger is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by the
+ * Free Software Foundation, either version 2 of the License.
+ *
+ * You can also redistribute rotation logger and/or modify it under the
+ * terms of the Lesser GNU General Public License as published by the Free
+ * Software Foundation, either version 3 of the License, or (at your option)
+ * any later version when this library is disributed with and as part of the
+ * EPICS QT Framework (https://github.com/qtepics).
+ *
+ * The rotation logger is distributed in the hope that it will be useful, but
+ * WITHOUT ANY WARRANTY; without even the implied warranty of MERCHANTABILITY
+ * or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU General Public License
+ * for more details.
+ *
+ * You should have received a copy of the GNU General Public License and
+ * the Lesser GNU General Public License along with rotation logger.
+ * If not, see <http://www.gnu.org/licenses/>.
+ *
+ * Contact details:
+ * andrew.starritt@gmail.com
+ * PO Box 3118, Prahran East, Victoria 3181, Australia.
+ *
+ */
+
+/* The rotation engine: the log state, file naming, writing, rotation and
+ * retention, and the background threads, as used by both the rotation_logger
+ * program and librotation_logger.a. This header is internal to the two; the
+ * library exports only the rl_ functions declared in rotation_logger.h.
+ */
+
+#ifndef ROTATION_ENGINE_H
+#define ROTATION_ENGINE_H
+
+#include <pthread.h>
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+#include <sys/types.h>
+#include <sys/uio.h>
+#include <time.h>
+#include <zlib.h>
+
+#include "rotation_logger.h"
+
+#define FULL_PATH_LEN    260
+#define RING_BUFFER_SIZE 65536
+#define GZIP_BUFFER_SIZE 65536
+#define STAMP_LENGTH     27       /* "YYYY-MM-DD HH:MM:SS.uuuuuu " */
+#define STAMP_IOV_MAX    256
+#define TIME_INDEX_SPACING 1000000  /* bytes between time index records */
+#define DEDUP_WINDOW_MAX 16
+#define DEDUP_LINE_MAX   1024     /* longest incomplete line held back */
+#define MAX_DIRECTORIES  8        /* striped or mirrored */
+#define MAX_COMPRESS_THREADS  16
+
+/*------------------------------------------------------------------------------
+ * In-memory index of this prefix's log files, oldest first.
+ * The directory is scanned at startup (and when re-synchronised); thereafter
+ * new files are appended by nextFile and purged files are removed from the
+ * front, so retention does not rescan the directory.
+ */
+typedef struct {
+   char* name;          /* filename only, i.e. no directory */
+   int dir;             /* directory number, 0 unless striping */
+   off_t size;
+   time_t mtime;
+} FileEntry;
+
+typedef struct {
+   FileEntry* entries;  /* circular buffer */
+   int capacity;
+   int first;
+   int count;
+   off_t totalSize;     /* of all the entries */
+   unsigned long appended;   /* entries ever appended, see indexScan */
+   pthread_mutex_t mutex;
+} FileIndex;
+
+#define INDEX_ENTRY(index, j)  ((index)->entries [((index)->first + (j)) % (index)->capacity])
+
+/*------------------------------------------------------------------------------
+ * File name date/time formats, see formatFileTime.
+ */
+enum NameFormat { NAME_SECONDS, NAME_MILLIS, NAME_MICROS, NAME_SEQUENCE };
+
+/*------------------------------------------------------------------------------
+ * Durability policy, see logSync.
+ */
+enum SyncMode { SYNC_NONE, SYNC_PERIODIC, SYNC_WRITEBEHIND };
+
+/*------------------------------------------------------------------------------
+ * Line timestamp prefix, formatted once per second.
+ */
+typedef struct {
+   time_t second;                /* of the cached image */
+   char image [STAMP_LENGTH + 1];
+} Stamp;
+
+/*------------------------------------------------------------------------------
+ * Repeated line suppression, see dedupSpan.
+ */
+typedef struct {
+   int window;                   /* number of recent lines compared, 0 for off */
+   int used;
+   int next;
+   uint64_t hashes [DEDUP_WINDOW_MAX];
+   size_t lengths [DEDUP_WINDOW_MAX];
+   uint64_t partialHash;         /* of a line written in part */
+   size_t partialLength;
+   bool midLine;
+   char pending [DEDUP_LINE_MAX];  /* incomplete line held back */
+   size_t pendingLength;
+   bool pendingTicked;           /* held since before the last tick */
+   unsigned long repeats;        /* suppressed since the last summary */
+   time_t firstRepeat;           /* of those */
+} Dedup;
+
+enum DedupAction { DEDUP_WRITE, DEDUP_PENDING, DEDUP_SUPPRESS, DEDUP_HOLD };
+
+/*------------------------------------------------------------------------------
+ * Log file write rate limit, see rateWrite.
+ */
+enum RatePolicy { RATE_DROP, RATE_SAMPLE, RATE_BLOCK };
+
+typedef struct {
+   long limit;                   /* bytes per second, 0 for no limit */
+   long burst;                   /* bytes, the bucket size */
+   enum RatePolicy policy;
+   int sample;                   /* write 1 in sample excess lines */
+   double tokens;                /* bytes, negative when in debt */
+   unsigned long long lastRefill;  /* monotonic ns */
+   bool midLine;
+   bool dropping;                /* the current line */
+   bool sampled;                 /* the current line, written but not counted */
+   unsigned long excess;         /* excess lines, for sampling */
+   unsigned long droppedLines;   /* since the last marker */
+   unsigned long long droppedBytes;
+   time_t firstDrop;             /* of those */
+} Rate;
+
+/*------------------------------------------------------------------------------
+ * Closed file waiting for the reaper to sync it, see requestSyncClose.
+ */
+typedef struct ClosingFile {
+   struct ClosingFile* next;
+   int fd;
+} ClosingFile;
+
+/*------------------------------------------------------------------------------
+ * Current log file state together with the rotation limits.
+ */
+typedef struct LogState {
+   const char* directory;        /* the first directory when striping */
+   const char* const* stripe;    /* directories files are striped across, or NULL */
+   int numberDirectories;        /* 1 unless striping */
+   int directoryNumber;          /* of the current file */
+   rl_logger* mirrors [MAX_DIRECTORIES];   /* copies, see mirrorStart */
+   int numberMirrors;
+   const char* prefix;
+   long sizeLimit;
+   long ageLimit;
+   int numberToKeep;
+   long maxTotal;                /* bytes for all files, 0 for no limit */
+   long maxAge;                  /* secs since closed, 0 for no limit */
+   int fd;
+   time_t lastTime;
+   size_t total;
+   char last_char;
+   FileIndex index;
+   struct LogState* reaperNext;  /* reaper queue link */
+   bool reaperQueued;
+   bool purgeRequested;
+   bool precreateRequested;
+   double precreateFraction;     /* 0 for no pre-creation */
+   bool precreatePending;        /* requested, but not yet used by nextFile */
+   int spareFd;                  /* pre-created next file, or -1 */
+   int spareDirectory;           /* the number of its directory */
+   bool preallocate;             /* fallocate up to the size limit */
+   enum NameFormat nameFormat;
+   bool lineAlign;               /* size rotation only at line boundaries */
+   bool wholeWrites;             /* size rotation only between writes, see plainWrite */
+   bool timestamp;               /* prefix each line with the time */
+   Stamp stamp;
+   Dedup dedup;
+   Rate rate;
+   long long lastNameUnits;      /* time of previous file name, format units */
+   int sequence;
+   int resyncPeriod;             /* seconds, 0 for never */
+   bool compress;                /* gzip closed files */
+   int compressPending;          /* files queued for compression */
+   bool gzip;                    /* write the active file as a gzip stream */
+   bool sizeCompressed;          /* size limit applies to the compressed size */
+   z_stream zs;
+   Bytef* zbuffer;
+   size_t compressedTotal;
+   time_t lastFlush;
+   bool unflushed;               /* compressed data not sync flushed */
+   bool lastCharUnknown;         /* data was spliced, last_char not valid */
+   time_t lastResync;
+   enum SyncMode syncMode;
+   long syncInterval;            /* ms */
+   long syncBytes;               /* 0 for time only */
+   unsigned long long lastSync;  /* monotonic ns */
+   size_t syncedOffset;          /* synced, or writeback started */
+   size_t waitedOffset;          /* write-behind: writeback complete */
+   ClosingFile* closingHead;     /* closed files for the reaper to sync, oldest first */
+   ClosingFile* closingTail;
+   bool resume;                  /* continue the newest file on startup */
+   bool timeIndex;               /* write a time index sidecar for each file */
+   int timeIndexFd;
+   time_t timeIndexSecond;       /* of the last record */
+   size_t timeIndexOffset;
+   bool framed;                  /* length prefixed records, see framedWrite */
+   bool frameError;              /* bad record length, input discarded */
+   char* frame;                  /* incomplete record carried over */
+   size_t frameUsed;
+   size_t frameSize;             /* allocated */
+} LogState;
+
+#define LOG_DIRECTORY(log, d)  ((d) > 0 ? (log)->stripe [d] : (log)->directory)
+
+/*------------------------------------------------------------------------------
+ * Runtime statistics. The counters are updated with relaxed atomic adds (no
+ * locking), so are cheap enough to be always on. Read and write operations are
+ * system calls, or io_uring requests, and include those for standard output.
+ * The program provides the counters as statsSink; the library has none, so
+ * counts nothing.
+ */
+typedef struct {
+   unsigned long long bytesIn;
+   unsigned long long bytesOut;        /* to the log files, before any compression */
+   unsigned long long bytesOutput;     /* to standard output */
+   unsigned long long reads;
+   unsigned long long writes;
+   unsigned long long mismatches;      /* short or failed writes */
+   unsigned long long mismatchBytes;
+   unsigned long long dropped;         /* bytes */
+   unsigned long long outputDropped;   /* standard output bytes */
+   unsigned long long rotations;
+   unsigned long long nextFileNs;
+   unsigned long long nextFileMaxNs;
+   unsigned long long purged;          /* files */
+   unsigned long long purgeNs;
+   unsigned long long purgeMaxNs;
+   unsigned long long maxStallNs;      /* longest write of one chunk to the log */
+   unsigned long long dedupLines;      /* repeated lines suppressed */
+   unsigned long long dedupBytes;
+   unsigned long long rateLines;       /* lines dropped by the rate limit */
+   unsigned long long rateBytes;
+   unsigned long long rateBlockedNs;   /* waiting for the rate limit */
+   unsigned long long forwardBytes;    /* sent to the forwarding sink */
+   unsigned long long forwardDropped;  /* bytes, queue full or undeliverable */
+   unsigned long long forwardBacklog;  /* bytes queued, current */
+   unsigned long long forwardConnects;
+   unsigned long long syncs;           /* fdatasync and sync_file_range calls */
+   unsigned long long syncNs;
+   unsigned long long syncMaxNs;
+} Stats;
+
+extern Stats* statsSink;
+
+/* Set by the writer threads of mirror loggers, whose output would otherwise be
+ * counted again for each mirror.
+ */
+extern __thread bool statsExcluded;
+
+#define STATS_ADD(field, n)   \
+   do { if (statsSink && !statsExcluded) \
+           __atomic_fetch_add (&statsSink->field, (n), __ATOMIC_RELAXED); } while (0)
+
+#define STATS_MAX(field, value)   \
+   do { if (statsSink) statsMax (&statsSink->field, (value)); } while (0)
+
+/*------------------------------------------------------------------------------
+ * Time index.
+ * Each log file may have a sidecar file, <prefix>_YYYY-MM-DD_HH-MM-SS.idx, of
+ * fixed size records mapping a time to the offset of the data written at that
+ * time. A record is written when the file is created, when the second changes
+ * and every TIME_INDEX_SPACING bytes, so the index is small and costs about one
+ * write per second. Offsets are always into the uncompressed data.
+ */
+typedef struct {
+   int64_t time;        /* microseconds since the epoch */
+   uint64_t offset;     /* bytes */
+} TimeIndexRecord;
+
+/*------------------------------------------------------------------------------
+ * A gather list for timestamped output, pointing into the input data.
+ */
+typedef struct {
+   struct iovec iov [STAMP_IOV_MAX];
+   int count;
+   size_t consumed;              /* input bytes described */
+   size_t length;                /* output bytes described */
+} StampedList;
+
+/* Utilities.
+ */
+void perrorf (const char* format, ...);
+unsigned long long monotonicNs ();
+void statsMax (unsigned long long* field, const unsigned long long value);
+size_t writeAll (const int fd, const void* data, const size_t count);
+size_t writevAll (const int fd, struct iovec* iov, int count);
+
+/* The file index and time index, see indexScan and timeIndexNote.
+ */
+void indexClear (FileIndex* index);
+bool indexScan (FileIndex* index, const char* const* directories,
+                const int numberDirectories, const char* prefix);
+void timeIndexPath (char* path, const size_t size, const char* name);
+void timeIndexNote (LogState* log);
+
+/* Timestamps and repeated line suppression, also used for standard output.
+ */
+const char* stampUpdate (Stamp* stamp);
+void stampLines (StampedList* list, const char* stamp, const char* data,
+                 const size_t count, bool atLineStart, const size_t room,
+                 const bool canSplit);
+size_t dedupSpan (Dedup* dedup, const char* data, const size_t count,
+                  enum DedupAction* action);
+size_t dedupRelease (Dedup* dedup);
+size_t dedupSummary (Dedup* dedup, char* buffer, const size_t size);
+bool dedupSummaryDue (const Dedup* dedup);
+
+/* The background reaper and compressor threads, shared by all the logs.
+ */
+void reaperStart (LogState* resyncLog);
+void reaperStop ();
+void requestPurge (LogState* log);
+void compressorStart (const int number);
+void compressorStop ();
+
+/* The log: file creation, writing, rotation and retention. The loops that feed
+ * a log call logWrite, or write to log->fd themselves and then use rotationDue
+ * and rotateFile.
+ */
+int nextFile (LogState* log);
+bool logStart (LogState* log);
+int logWrite (LogState* log, const char* data, const size_t count);
+void logTick (LogState* log);
+void logSync (LogState* log);
+size_t unseenRoom (const LogState* log, const size_t maximum);
+bool rotationDue (LogState* log);
+bool rotateFile (LogState* log);
+void logFinish (LogState* log);
+void sanitiseLimits (long* ageLimit, long* sizeLimit, int* numberToKeep,
+                     const bool timestamp);
+
+/* Mirrors, see mirrorStart.
+ */
+bool mirrorStart (LogState* log, const LogState* settings,
+                  const char* const* directories, const int number);
+void mirrorStop (LogState* log);
+
+#endif  /* ROTATION_ENGINE_H */
@@ -0,0 +1,243 @@
+/* rotation_libtest.c
+ *
+ * Copyright (C) 2019-2023  Andrew C. Starritt
+ * All rights reserved.
+ *
+ * The rotation logger is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by the
+ * Free Software Foundation, either version 2 of the License.
+ *
+ * The rotation logger is distributed in the hope that it will be useful, but
+ * WITHOUT ANY WARRANTY; without even the implied warranty of MERCHANTABILITY
+ * or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU General Public License
+ * for more details.
+ *
+ * You should have received a copy of the GNU General Public License along
+ * with rotation logger. If not, see <http://www.gnu.org/licenses/>.
+ *
+ * Contact details:
+ * andrew.starritt@gmail.com
+ * PO Box 3118, Prahran East, Victoria 3181, Australia.
+ *
+ */
+
+/* Behaviour test of the rotation logger library, run by rotation_test.sh.
+ *
+ * A number of threads write numbered records concurrently through one logger,
+ * with a small queue limit so that rl_write also fails with EAGAIN and is
+ * retried. Once rl_close returns, the files are read back in name order and
+ * checked: every record is present, once, complete and in the order written by
+ * its thread; each file starts with a record and is within the size limit.
+ * Every fifth record spans two lines, so that an interleaving of records would
+ * be seen.
+ */
+
+#define _GNU_SOURCE
+
+#include <errno.h>
+#include <dirent.h>
+#include <pthread.h>
+#include <sched.h>
+#include <stdbool.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/stat.h>
+
+#include "rotation_logger.h"
+
+#define MAX_THREADS   32
+#define RECORD_MAX    1024
+#define SIZE_LIMIT    20000
+
+static rl_logger* logger = NULL;
+static int numberRecords = 0;
+
+/*------------------------------------------------------------------------------
+ * Record i of thread t: "[t i xxx...]\n", every fifth with a second line.
+ */
+static int recordFormat (char* record, const int t, const int i)
+{
+   int n = snprintf (record, RECORD_MAX, "[%d %d ", t, i);
+   const int fill = (i * 37 + t) % 600;
+
+   memset (record + n, 'x', fill);
+   n += fill;
+   if (i % 5 == 0) {
+      memcpy (record + n, "\nxx", 3);
+      n += 3;
+   }
+   memcpy (record + n, "]\n", 2);
+   return n + 2;
+}
+
+/*------------------------------------------------------------------------------
+ */
+static void* producer (void* arg)
+{
+   const int t = (int) (long) arg;
+   char record [RECORD_MAX];
+   int i;
+
+   for (i = 0; i < numberRecords; i++) {
+      const int n = recordFormat (record, t, i);
+      while (rl_write (logger, record, n) < 0) {
+         if (errno != EAGAIN) {
+            perror ("rl_write");
+            return NULL;
+         }
+         sched_yield ();
+      }
+   }
+   return NULL;
+}
+
+/*------------------------------------------------------------------------------
+ * Check the records in one file, which must start with a record. Returns false
+ * on the first error found.
+ */
+static bool checkFile (const char* path, const char* data, const size_t size,
+                       int* next, const int numberThreads)
+{
+   char expected [RECORD_MAX];
+   size_t offset = 0;
+
+   if (size > SIZE_LIMIT) {
+      fprintf (stderr, "%s: size %ld over the %d limit\n", path, (long) size, SIZE_LIMIT);
+      return false;
+   }
+
+   while (offset < size) {
+      int t, i, n;
+
+      if (data [offset] != '[' || sscanf (data + offset, "[%d %d ", &t, &i) != 2 ||
+          t < 0 || t >= numberThreads) {
+         fprintf (stderr, "%s: no record at offset %ld\n", path, (long) offset);
+         return false;
+      }
+      if (i != next [t]) {
+         fprintf (stderr, "%s: thread %d record %d, expected %d\n", path, t, i, next [t]);
+         return false;
+      }
+      n = recordFormat (expected, t, i);
+      if (offset + n > size || memcmp (data + offset, expected, n) != 0) {
+         fprintf (stderr, "%s: thread %d record %d incomplete or interleaved\n", path, t, i);
+         return false;
+      }
+      next [t]++;
+      offset += n;
+   }
+   return true;
+}
+
+/*------------------------------------------------------------------------------
+ */
+static int nameCompare (const struct dirent** a, const struct dirent** b)
+{
+   return strcmp ((*a)->d_name, (*b)->d_name);
+}
+
+/*------------------------------------------------------------------------------
+ */
+static int logFilter (const struct dirent* entry)
+{
+   const size_t length = strlen (entry->d_name);
+   return length > 4 && strcmp (entry->d_name + length - 4, ".log") == 0;
+}
+
+/*------------------------------------------------------------------------------
+ * Read back and check all the log files in directory.
+ */
+static bool checkDirectory (const char* directory, const int numberThreads)
+{
+   struct dirent** names;
+   int next [MAX_THREADS] = { 0 };
+   bool okay = true;
+   int count;
+   int j;
+
+   count = scandir (directory, &names, logFilter, nameCompare);
+   if (count < 0) {
+      perror (directory);
+      return false;
+   }
+
+   for (j = 0; j < count; j++) {
+      char path [4096];
+      struct stat st;
+      char* data;
+      FILE* file;
+
+      snprintf (path, sizeof (path), "%s/%s", directory, names [j]->d_name);
+      file = okay ? fopen (path, "r") : NULL;
+      if (file && fstat (fileno (file), &st) == 0 && (data = malloc (st.st_size + 1))) {
+         okay = fread (data, 1, st.st_size, file) == (size_t) st.st_size &&
+                checkFile (path, data, st.st_size, next, numberThreads);
+         free (data);
+      } else if (okay) {
+         perror (path);
+         okay = false;
+      }
+      if (file) fclose (file);
+      free (names [j]);
+   }
+   free (names);
+
+   for (j = 0; okay && j < numberThreads; j++) {
+      if (next [j] != numberRecords) {
+         fprintf (stderr, "thread %d: %d records written, expected %d\n",
+                  j, next [j], numberRecords);
+         okay = false;
+      }
+   }
+   if (okay) {
+      printf ("%d threads, %d records, %d files\n", numberThreads,
+              numberThreads * numberRecords, count);
+   }
+   return okay;
+}
+
+/*------------------------------------------------------------------------------
+ */
+int main (int argc, char** argv)
+{
+   pthread_t threads [MAX_THREADS];
+   rl_options options;
+   int numberThreads;
+   long j;
+
+   if (argc != 5) {
+      fprintf (stderr, "usage: rotation_libtest directory prefix threads records\n");
+      return 2;
+   }
+   numberThreads = atoi (argv [3]);
+   numberRecords = atoi (argv [4]);
+   if (numberThreads < 1 || numberThreads > MAX_THREADS || numberRecords < 1) {
+      fprintf (stderr, "threads must be 1 to %d, records >= 1\n", MAX_THREADS);
+      return 2;
+   }
+
+   rl_options_init (&options);
+   options.sizeLimit = SIZE_LIMIT;
+   options.numberToKeep = 100000;
+   options.nameFormat = RL_NAME_SEQUENCE;
+   options.queueLimit = 65536;
+
+   logger = rl_open (argv [1], argv [2], &options);
+   if (!logger) {
+      perror ("rl_open");
+      return 1;
+   }
+
+   for (j = 0; j < numberThreads; j++) {
+      pthread_create (&threads [j], NULL, producer, (void*) j);
+   }
+   for (j = 0; j < numberThreads; j++) {
+      pthread_join (threads [j], NULL);
+   }
+   rl_close (logger);
+
+   return checkDirectory (argv [1], numberThreads) ? 0 : 1;
+}
+
+/* end */
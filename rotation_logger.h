@@ -0,0 +1,129 @@
+/* rotation_logger.h
+ *
+ * Copyright (C) 2019-2023  Andrew C. Starritt
+ * All rights reserved.
+ *
+ * The rotation logger is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by the
+ * Free Software Foundation, either version 2 of the License.
+ *
+ * You can also redistribute rotation logger and/or modify it under the
+ * terms of the Lesser GNU General Public License as published by the Free
+ * Software Foundation, either version 3 of the License, or (at your option)
+ * any later version when this library is disributed with and as part of the
+ * EPICS QT Framework (https://github.com/qtepics).
+ *
+ * The rotation logger is distributed in the hope that it will be useful, but
+ * WITHOUT ANY WARRANTY; without even the implied warranty of MERCHANTABILITY
+ * or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU General Public License
+ * for more details.
+ *
+ * You should have received a copy of the GNU General Public License and
+ * the Lesser GNU General Public License along with rotation logger.
+ * If not, see <http://www.gnu.org/licenses/>.
+ *
+ * Contact details:
+ * andrew.starritt@gmail.com
+ * PO Box 3118, Prahran East, Victoria 3181, Australia.
+ *
+ */
+
+/* In-process rotation logger, librotation_logger.a.
+ *
+ * Any number of application threads may call rl_write concurrently: records are
+ * appended to a lock-free queue and written to the log files, with rotation and
+ * retention as per the rotation_logger program, by a background thread. Each
+ * record is written contiguously, i.e. records from different threads are never
+ * interleaved, and files are only rotated on size between records, a record
+ * larger than the size limit going in a file of its own. (With dedup or a rate
+ * limit, which work line by line, a multi-line record may still be split.)
+ * Link with -lrotation_logger -lz -pthread.
+ */
+
+#ifndef ROTATION_LOGGER_H
+#define ROTATION_LOGGER_H
+
+#include <stddef.h>
+#include <sys/types.h>
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+/* Log file name formats, as per --name-format.
+ */
+#define RL_NAME_SECONDS     0
+#define RL_NAME_MILLIS      1
+#define RL_NAME_MICROS      2
+#define RL_NAME_SEQUENCE    3
+
+/* Durability policies, as per --sync.
+ */
+#define RL_SYNC_NONE        0
+#define RL_SYNC_PERIODIC    1
+#define RL_SYNC_WRITEBEHIND 2
+
+/* Excess line policies, as per --rate-policy.
+ */
+#define RL_RATE_DROP        0
+#define RL_RATE_SAMPLE      1
+#define RL_RATE_BLOCK       2
+
+typedef struct rl_logger rl_logger;
+
+/* The options correspond to the rotation_logger program options of the same
+ * name, and take the same defaults as set by rl_options_init.
+ */
+typedef struct rl_options {
+   long sizeLimit;         /* bytes, --size */
+   long ageLimit;          /* secs, --age */
+   int numberToKeep;       /* --keep */
+   long maxTotal;          /* bytes, --max-total, 0 for no limit */
+   long maxAge;            /* secs, --max-age, 0 for no limit */
+   int nameFormat;         /* RL_NAME_... */
+   int compress;           /* --compress */
+   int gzip;               /* --gzip */
+   int lineAlign;          /* --line-align */
+   int timestamp;          /* --timestamp file */
+   int timeIndex;          /* --time-index */
+   int resume;             /* --resume */
+   int framed;             /* --framed, each rl_write one record, with its header */
+   int dedup;              /* --dedup window, 0 for off */
+   long maxRate;           /* bytes/sec, --max-rate, 0 for no limit */
+   long rateBurst;         /* bytes, 0 for one second at maxRate */
+   int ratePolicy;         /* RL_RATE_... */
+   int rateSample;         /* 1 in N, default 10 */
+   int sync;               /* RL_SYNC_... */
+   long syncInterval;      /* ms */
+   long syncBytes;         /* 0 for the mode dependent default */
+   long queueLimit;        /* bytes queued before rl_write fails, default 16M */
+} rl_options;
+
+/* Set the default options.
+ */
+void rl_options_init (rl_options* options);
+
+/* Create the directory if need be, open the first log file and start the
+ * background thread. Options may be NULL for the defaults.
+ * Returns NULL on failure.
+ */
+rl_logger* rl_open (const char* directory, const char* prefix, const rl_options* options);
+
+/* Queue a record for writing. Never blocks.
+ * Returns count, or -1 with errno set to EAGAIN if the queue limit has been
+ * reached (the record is dropped and counted), ENOMEM, or EIO if the log can
+ * no longer be written.
+ */
+ssize_t rl_write (rl_logger* logger, const void* data, size_t count);
+
+/* Write any queued records, close the current file and release the logger.
+ * Rotated files always end with a newline; the last file ends as the last
+ * record did.
+ */
+void rl_close (rl_logger* logger);
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif  /* ROTATION_LOGGER_H */
@@ -0,0 +1,234 @@
+#!/bin/bash
+#
+# Behaviour tests for rotation_logger and its library, run by "make test".
+#
+# Fixed input is piped through the program and the resulting log files are
+# checked, by content and size, against what the options promise. Each test
+# runs in a fresh directory under a temporary work directory, and the script
+# exits non-zero if any test fails.
+#
+
+LOGGER=${LOGGER:-./rotation_logger}
+LIBTEST=${LIBTEST:-./rotation_libtest}
+
+WORK=$(mktemp -d "${TMPDIR:-/tmp}/rotation_test.XXXXXX") || exit 1
+trap 'rm -rf "${WORK}"' EXIT
+
+failures=0
+current=""
+
+# Start a test: announce it and give it an empty log directory, ${WORK}/logs.
+#
+begin () {
+    current="$1"
+    rm -rf "${WORK}/logs"
+    printf "%-40s" "${current}"
+}
+
+fail () {
+    echo "FAIL: $*"
+    failures=$((failures + 1))
+    current=""
+}
+
+pass () {
+    [ -n "${current}" ] && echo "ok"
+    current=""
+}
+
+# The log files in name order, i.e. the order they were written in.
+#
+logs () {
+    ls "${WORK}"/logs/*.log 2>/dev/null | sort
+}
+
+# Fail unless every log file is at most $1 bytes.
+#
+check_sizes () {
+    local file size
+    for file in $(logs) ; do
+        size=$(stat -c %s "${file}")
+        if [ "${size}" -gt "$1" ] ; then
+            fail "$(basename "${file}") is ${size} bytes, over the $1 limit"
+            return
+        fi
+    done
+}
+
+# Fail unless the concatenated log files are identical to file $1.
+#
+check_content () {
+    if ! cat $(logs) | cmp -s - "$1" ; then
+        fail "log file content differs from $(basename "$1")"
+    fi
+}
+
+# Fail unless the number of log files is $1.
+#
+check_count () {
+    local count=$(logs | wc -l)
+    if [ "${count}" -ne "$1" ] ; then
+        fail "${count} log files, expected $1"
+    fi
+}
+
+# A framed record: 4 byte big endian length, then the data.
+#
+frame () {
+    local n=${#1}
+    printf "\\x$(printf %02x $((n >> 24 & 255)))\\x$(printf %02x $((n >> 16 & 255)))"
+    printf "\\x$(printf %02x $((n >> 8 & 255)))\\x$(printf %02x $((n & 255)))%s" "$1"
+}
+
+# Walk the records of framed file $1, printing the number of records, or
+# "bad" if the file does not end on a record boundary.
+#
+frame_walk () {
+    od -An -v -tu1 "$1" | tr -s ' ' '\n' | grep -v '^$' | awk '
+        { b [n++] = $1 }
+        END {
+            p = 0; records = 0
+            while (p + 4 <= n) {
+                p += 4 + b [p] * 16777216 + b [p + 1] * 65536 + b [p + 2] * 256 + b [p + 3]
+                records++
+            }
+            print (p == n) ? records : "bad"
+        }'
+}
+
+seq 1 20000 > "${WORK}/lines"
+
+# Rotation on size, line aligned, through each of the I/O modes. The output
+# must be the input exactly, with every file within the limit.
+#
+for mode in "" "--threaded" "--zero-copy" "--uring" "--coalesce 5" "--buffer 64K" ; do
+    begin "line aligned rotation ${mode:---copy}"
+    ${LOGGER} -l -s 10000 -k 1000 -n sequence ${mode} "${WORK}/logs" t \
+        < "${WORK}/lines" 2>/dev/null | cmp -s - "${WORK}/lines" ||
+        fail "standard output differs from the input"
+    [ -n "${current}" ] && check_count 11
+    [ -n "${current}" ] && check_sizes 10000
+    [ -n "${current}" ] && check_content "${WORK}/lines"
+    pass
+done
+
+# Retention: only the current file and --keep older files remain, and they are
+# the most recent.
+#
+begin "retention"
+${LOGGER} -q -l -s 10000 -k 3 -n sequence "${WORK}/logs" t < "${WORK}/lines" 2>/dev/null
+check_count 4
+[ -n "${current}" ] && [ "$(cat $(logs) | tail -1)" != "20000" ] && fail "newest data missing"
+pass
+
+# Library: concurrent rl_write from several threads through the lock-free
+# queue, then rl_close. The test program checks the files itself.
+#
+begin "library queue and close"
+${LIBTEST} "${WORK}/logs" r 8 20000 > "${WORK}/libtest.out" 2>&1 ||
+    fail "$(head -1 "${WORK}/libtest.out")"
+pass
+
+# Dedup: repeats are replaced by a summary when the repetition ends, or at the
+# end of the input; an incomplete last line is still written.
+#
+begin "dedup previous line"
+printf 'a\na\na\nb\nc\nc\nd\nd\nd\nd\ntail' > "${WORK}/dedup.in"
+printf 'a\nlast message repeated 2 times\nb\nc\nlast message repeated 1 times\nd\nlast message repeated 3 times\ntail' \
+    > "${WORK}/dedup.expected"
+${LOGGER} -m 1 -n sequence "${WORK}/logs" t < "${WORK}/dedup.in" 2>/dev/null |
+    cmp -s - "${WORK}/dedup.in" || fail "standard output was not passed through"
+[ -n "${current}" ] && check_content "${WORK}/dedup.expected"
+pass
+
+begin "dedup window and output"
+printf 'x\ny\nx\ny\nx\nz\n' > "${WORK}/dedup.in"
+printf 'x\ny\n3 repeated lines suppressed\nz\n' > "${WORK}/dedup.expected"
+${LOGGER} -m 2 -o -n sequence "${WORK}/logs" t < "${WORK}/dedup.in" 2>/dev/null |
+    cmp -s - "${WORK}/dedup.expected" || fail "standard output was not deduplicated"
+[ -n "${current}" ] && check_content "${WORK}/dedup.expected"
+pass
+
+# Framed records: files hold whole records only, within the size limit except
+# for a record larger than the limit, which is alone in its file.
+#
+begin "framed records"
+for i in $(seq 1 200) ; do
+    frame "record ${i} $(printf '%*s' $((i * 7 % 90)) '' | tr ' ' x)"
+    [ $((i % 50)) -eq 0 ] && frame "$(printf '%*s' 700 '' | tr ' ' y)"
+done > "${WORK}/framed"
+${LOGGER} -q -V -s 500 -k 1000 -n sequence "${WORK}/logs" t < "${WORK}/framed" 2>/dev/null
+check_content "${WORK}/framed"
+for file in $(logs) ; do
+    [ -n "${current}" ] || break
+    records=$(frame_walk "${file}")
+    size=$(stat -c %s "${file}")
+    if [ "${records}" = "bad" ] ; then
+        fail "$(basename "${file}") does not end on a record boundary"
+    elif [ "${size}" -gt 500 ] && [ "${records}" -ne 1 ] ; then
+        fail "$(basename "${file}") is over the limit with ${records} records"
+    fi
+done
+pass
+
+# Resume: a second run continues the newest file, including a partial last
+# line, and the resumed file is still rotated at the size limit.
+#
+begin "resume"
+printf 'one\ntwo\npart' | ${LOGGER} -q -e -n sequence "${WORK}/logs" t 2>/dev/null
+printf 'ial\n' | ${LOGGER} -q -e -n sequence "${WORK}/logs" t 2>/dev/null
+printf 'one\ntwo\npartial\n' > "${WORK}/resume.expected"
+check_count 1
+[ -n "${current}" ] && check_content "${WORK}/resume.expected"
+pass
+
+begin "resume at the size limit"
+seq 1 30 | ${LOGGER} -q -e -l -s 60 -n sequence "${WORK}/logs" t 2>/dev/null
+seq 31 40 | ${LOGGER} -q -e -l -s 60 -n sequence "${WORK}/logs" t 2>/dev/null
+seq 1 40 > "${WORK}/resume.expected"
+check_count 2
+[ -n "${current}" ] && check_sizes 60
+[ -n "${current}" ] && check_content "${WORK}/resume.expected"
+pass
+
+begin "no resume"
+printf 'one\n' | ${LOGGER} -q -n sequence "${WORK}/logs" t 2>/dev/null
+printf 'two\n' | ${LOGGER} -q -n sequence "${WORK}/logs" t 2>/dev/null
+check_count 2
+pass
+
+# Time index: input in two seconds gives two records, the second at the offset
+# of the second batch, and --lookup maps times to those offsets.
+#
+begin "time index and lookup"
+seq 1 1000 > "${WORK}/first"
+(cat "${WORK}/first" ; sleep 1.2 ; seq 1001 2000) |
+    ${LOGGER} -q -x -n sequence "${WORK}/logs" t 2>/dev/null
+log=$(logs)
+index=${log%.log}.idx
+first=$(stat -c %s "${WORK}/first")
+records=($(od -An -v -tu8 "${index}" 2>/dev/null))
+if [ ${#records[@]} -ne 4 ] ; then
+    fail "index has $((${#records[@]} / 2)) records, expected 2"
+elif [ "${records[1]}" -ne 0 ] || [ "${records[3]}" -ne "${first}" ] ; then
+    fail "index offsets ${records[1]} ${records[3]}, expected 0 ${first}"
+else
+    second=$((records[2] / 1000000 + 1))
+    [ "$(${LOGGER} --lookup "@$((records[0] / 1000000))" "${log}")" = "0" ] ||
+        fail "lookup of the first second"
+    [ -n "${current}" ] && [ "$(${LOGGER} --lookup "@${second}" "${log}")" != "${first}" ] &&
+        fail "lookup of the second second"
+    [ -n "${current}" ] && [ "$(${LOGGER} --lookup "@${second}" "${index}")" != "${first}" ] &&
+        fail "lookup via the index file"
+    [ -n "${current}" ] && [ "$(tail -c +$((first + 1)) "${log}" | head -1)" != "1001" ] &&
+        fail "data at the looked up offset"
+fi
+pass
+
+if [ ${failures} -gt 0 ] ; then
+    echo "${failures} test(s) failed"
+    exit 1
+fi
+echo "all tests passed"
+
+# end